@@ -0,0 +1,104 @@
+#!/bin/sh
+# Benchmarks for sshell: command launch latency and pipeline throughput.
+#
+# usage: bench/run.sh [path/to/sshell]
+#
+# Every result is printed as one JSON object per line on stdout.
+# BENCH_N: commands per launch workload (default 2000)
+# BENCH_MB: size of the file pushed through pipelines (default 64)
+# BENCH_STAGES: pipeline lengths to measure (default "1 2 4 8")
+# BENCH_PIPESIZE: capacity of the pipelines' pipes, e.g. 1M (default: the kernel's)
+
+SSHELL=${1:-./sshell}
+N=${BENCH_N:-2000}
+MB=${BENCH_MB:-64}
+STAGES=${BENCH_STAGES:-1 2 4 8}
+PIPESIZE=${BENCH_PIPESIZE:-0}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/sshell-bench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+now_ns() {
+        date +%s%N
+}
+
+# repeat LINE N: write LINE N times, one per line
+repeat() {
+        awk -v line="$1" -v n="$2" 'BEGIN { for (i = 0; i < n; i++) print line }'
+}
+
+# launch NAME LINE [ENV]: run LINE N times in one script, and report the
+# commands per second and the latency of each command from "time"
+launch() {
+        name=$1
+        line=$2
+        repeat "$line" "$N" > "$WORK/$name.sh"
+        start=$(now_ns)
+        env $3 "$SSHELL" -q -t "$WORK/$name.sh" > /dev/null 2> "$WORK/$name.log"
+        end=$(now_ns)
+        grep '^+ time total ' "$WORK/$name.log" |
+                awk '{ sub("s$", "", $5); print $5 * 1000000 }' |
+                sort -n |
+                awk -v name="$name" -v n="$N" -v ns=$((end - start)) '
+                        { us[NR] = $1 }
+                        END {
+                                if (NR == 0) {
+                                        printf "{\"bench\":\"%s\",\"error\":\"no timing\"}\n", name
+                                        exit
+                                }
+                                p50 = us[int((NR - 1) * 0.50) + 1]
+                                p99 = us[int((NR - 1) * 0.99) + 1]
+                                printf "{\"bench\":\"%s\",\"commands\":%d,\"commands_per_sec\":%.1f,\"p50_us\":%d,\"p99_us\":%d}\n",
+                                        name, n, n / (ns / 1e9), p50, p99
+                        }'
+}
+
+# pipeline NAME CAT K: push the file through K stages of CAT, /bin/cat
+# for a pipeline of processes, cat for the shell's builtin
+pipeline() {
+        name=$1
+        cat=$2
+        k=$3
+        line="pipesize=$PIPESIZE $cat $WORK/data.bin"
+        i=1
+        while [ "$i" -lt "$k" ]; do
+                line="$line | $cat"
+                i=$((i + 1))
+        done
+        echo "$line > /dev/null" > "$WORK/$name$k.sh"
+        "$SSHELL" -q -t "$WORK/$name$k.sh" 2> "$WORK/$name$k.log"
+        awk -v name="$name" -v k="$k" -v mb="$MB" '/^\+ time total / {
+                sub("s$", "", $5)
+                seconds = $5
+        }
+        /^\+ time pipes / {
+                sub("kB$", "", $6)
+                pipe_kb = $6
+        }
+        END {
+                printf "{\"bench\":\"%s\",\"stages\":%d,\"mb\":%d,\"pipe_kb\":%d,\"seconds\":%s,\"mb_per_sec\":%.1f}\n",
+                        name, k, mb, pipe_kb, seconds, (seconds > 0 ? mb / seconds : 0)
+        }' "$WORK/$name$k.log"
+}
+
+if [ ! -x "$SSHELL" ]; then
+        echo "bench: $SSHELL is not executable" >&2
+        exit 1
+fi
+
+launch launch_spawn /bin/true SSHELL_LAUNCH=spawn
+launch launch_fork /bin/true SSHELL_LAUNCH=fork
+launch launch_zygote /bin/true SSHELL_LAUNCH=zygote
+launch builtin_true true
+echo x > "$WORK/in.txt"
+: > "$WORK/out.txt"
+launch redirect_out "/bin/echo x > $WORK/out.txt"
+launch redirect_in "/bin/cat < $WORK/in.txt"
+
+head -c $((MB * 1024 * 1024)) /dev/zero > "$WORK/data.bin"
+for k in $STAGES; do
+        pipeline pipeline /bin/cat "$k"
+done
+for k in $STAGES; do
+        pipeline pipeline_builtin cat "$k"
+done
@@ -1,38 +1,492 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define CMDLINE_MAX 512
-#define MAX_ARGUMENT 16
-#define MAX_TOKEN_LEN 32
-#define MAX_PIPES 4
-#define FAIL_CD -1
+#define ARENA_CHUNK 4096
+#define INPUT_CHUNK 65536
+#define COPY_CHUNK (1 << 20)
+#define MAX_FD_ACTIONS 16
+#define MAX_REDIRECT_FD 10
+#define HASH_BUCKETS 256
+#define DIR_CACHE_SIZE 8
+#define DENTS_BUF 65536
+#define ZYGOTE_MSG_MAX 65536
+#define HISTORY_RECENT 4096
+#define HISTORY_BLOCK 256
+#define MAX_LIMITS 8
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define STAT_BUCKETS 252
+
+// One redirection of a command. They are applied in the order they were
+// typed, after the pipes, so "> file 2>&1" sends both to the file.
+// REDIR_OPEN: fd is the file word, opened with flags ('<', '>', '>>')
+// REDIR_DUP: fd is a copy of target ('<&', '>&')
+// REDIR_CLOSE: fd is closed ('<&-', '>&-')
+// REDIR_HERE_STRING: fd reads the word and a '\n' ('<<<')
+// REDIR_HERE_DOC: fd reads the lines following the command line ('<<'),
+// word is the line ending them until they are read
+enum RedirectKind {
+        REDIR_OPEN,
+        REDIR_DUP,
+        REDIR_CLOSE,
+        REDIR_HERE_STRING,
+        REDIR_HERE_DOC,
+};
+
+// opened: the file or memfd while the command is started, else -1
+struct Redirect {
+        enum RedirectKind kind;
+        int fd;
+        int target;
+        int flags;
+        char *word;
+        int opened;
+};
 
-// The basic command structure
+// The basic command structure, everything lives in the line's arena
 // cmd: the command entered by user
-// args: arguments followed by the command
-// filename: will be used whenever there is a '<' or '>'
+// args: arguments followed by the command, NULL terminated
+// argc: number of arguments, including the command
+// redirs: its redirections, in order
+// nredirs: number of redirections
+// limits: from its "limit" and "pin" prefixes, NULL without
 struct Command {
         char * cmd;
-        char *args[MAX_ARGUMENT+1];
-        char *filename;
+        char **args;
+        int argc;
+        struct Redirect *redirs;
+        int nredirs;
+        struct Limits *limits;
+};
+
+// The directory stack, top last. The top is the current directory, so
+// it is also the shell's logical $PWD, and no getcwd is needed.
+// dirs: the paths, interned so that a directory is stored only once
+// count: number of entries
+// cap: number of entries allocated
+struct DirStack {
+        const char **dirs;
+        int count;
+        int cap;
+};
+
+// One interned path
+struct InternEntry {
+        char *path;
+        struct InternEntry *next;
+};
+
+// Resources used by one stage, from wait4
+// start: when it was started, on the monotonic clock, zero if the shell
+// ran it itself
+// pid: its pid, kept once it is reaped
+// end: when it was reaped, on the monotonic clock
+// usage: its user and sys time, max RSS and context switches
+struct StageUsage {
+        struct timespec start;
+        pid_t pid;
+        struct timespec end;
+        struct rusage usage;
+};
+
+// The shell's own work that is timed, for "stats"
+// STAT_PARSE: parsing a line
+// STAT_EXPAND: expanding the words of a pipeline, and taking its prefixes
+// STAT_LOOKUP: finding a command, in the hash table or in $PATH
+// STAT_LAUNCH: starting a child, until the shell has its pid
+// STAT_EXIT: a child, from when it was started to when it was reaped
+// STAT_BUILTIN: a builtin the shell ran itself
+enum StatKind {
+        STAT_PARSE,
+        STAT_EXPAND,
+        STAT_LOOKUP,
+        STAT_LAUNCH,
+        STAT_EXIT,
+        STAT_BUILTIN,
+        STAT_KINDS,
+};
+
+// The times of one kind of work, in nanoseconds
+// count, total, min, max: over all of them
+// buckets: how many fell in each range, four ranges per power of two
+struct Stat {
+        uint64_t count;
+        uint64_t total;
+        uint64_t min;
+        uint64_t max;
+        uint32_t buckets[STAT_BUCKETS];
 };
 
-struct Node {
-        char curstack[CMDLINE_MAX];
-        struct Node *next;
+// How a pipeline is joined to the one before it
+// LIST_SEQ: always run, after ';' or '&' or first on the line
+// LIST_AND: run if the one before succeeded, after '&&'
+// LIST_OR: run if the one before failed, after '||'
+enum ListOp {
+        LIST_SEQ,
+        LIST_AND,
+        LIST_OR,
 };
 
-// The pipeline structure
-// cmds: commands list
-// pipes: pipe list
+// The pipeline structure, sized to the number of stages on the line and
+// allocated in the line's arena
+// cmds: commands list, one per stage
+// pipes: pipe list, one pipe between every two stages
+// pids: the pid of each stage once it is started
+// status: the exit status of each stage
+// count: number of stages
+// background: true when the pipeline ends with '&'
+// op: how it is joined to the pipeline before it
+// text: the pipeline as typed, for the "+ completed" line
+// usage: resources used by each stage
+// timed: report the resources once done, after "time" or with -t
+// pipesize: capacity of its pipes, after "pipesize=", 0 for the shell's
 struct Pipelines {
-        struct Command *cmds[MAX_PIPES];
-        int *pipes[MAX_PIPES];
+        struct Command *cmds;
+        int (*pipes)[2];
+        pid_t *pids;
+        int *status;
+        struct StageUsage *usage;
+        bool timed;
+        int pipesize;
+        int count;
+        bool background;
+        enum ListOp op;
+        char *text;
+};
+
+// A whole line: pipelines separated by ';', '&', '&&' or '||'
+struct CommandList {
+        struct Pipelines *pipelines;
+        int count;
+};
+
+// A running pipeline in the job table
+// id: the job number, 0 while it runs in the foreground
+// cmdline: the line it was started from
+// pgid: its process group
+// pids, status, count: the stages of the pipeline
+// running: number of stages not reaped yet
+// stopped: true when a stage was stopped, e.g. by ctrl-z
+// start: when it was started, on the monotonic clock
+// usage, timed: as in the pipeline
+// pipesize: the capacity its pipes really got, 0 without pipes
+struct Job {
+        int id;
+        char *cmdline;
+        pid_t pgid;
+        pid_t *pids;
+        int *status;
+        struct StageUsage *usage;
+        struct timespec start;
+        bool timed;
+        int pipesize;
+        int count;
+        int running;
+        bool stopped;
+        struct Job *next;
+};
+
+// Per-line memory. Chunks are kept when the arena is reset, so once it
+// has grown to fit the longest line, parsing a line allocates nothing.
+struct ArenaChunk {
+        struct ArenaChunk *next;
+        size_t size;
+        size_t used;
+        max_align_t data[];
+};
+
+struct Arena {
+        struct ArenaChunk *head;
+        struct ArenaChunk *cur;
+};
+
+// Tokens of the command line
+enum TokenKind {
+        TOK_WORD,
+        TOK_PIPE,
+        TOK_IN,
+        TOK_HERE_STRING,
+        TOK_HERE_DOC,
+        TOK_DUP_IN,
+        TOK_OUT,
+        TOK_APPEND,
+        TOK_DUP_OUT,
+        TOK_AMP,
+        TOK_SEMI,
+        TOK_AND,
+        TOK_OR,
+        TOK_END,
+        TOK_ERROR,
+};
+
+// A string growing in the arena
+struct StrBuf {
+        struct Arena *arena;
+        char *data;
+        size_t len;
+        size_t cap;
+};
+
+// The words a glob pattern expanded to, growing in the arena
+struct GlobMatches {
+        char **paths;
+        int count;
+        int cap;
+};
+
+// A directory listing, read with getdents64 and kept as long as the
+// directory's mtime does not change
+// path: the directory, as it appeared in the pattern
+// dev, ino, mtime: the directory when it was read
+// read_at: when it was read, in seconds since the epoch
+// names: each entry as its d_type byte, then its name and a '\0'
+// len, cap: bytes used and allocated in names
+// used: when it was last used, to drop the least recently used one
+struct DirCache {
+        char *path;
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+        time_t read_at;
+        char *names;
+        size_t len;
+        size_t cap;
+        unsigned long used;
+};
+
+// The lexer state
+// pos: the next character to read
+// arena: where words are copied to
+// fd: the number right before the last '<' or '>', or -1
+struct Lexer {
+        const char *pos;
+        struct Arena *arena;
+        int fd;
+};
+
+// What the child does to its file descriptors before exec, in order
+// FD_DUP: dup2(fd, target)
+// FD_CLOSE: close(fd)
+enum FdActionKind {
+        FD_DUP,
+        FD_CLOSE,
+};
+
+struct FdAction {
+        enum FdActionKind kind;
+        int fd;
+        int target;
+};
+
+// How "limit" reads the value of a resource
+enum LimitUnit {
+        LIMIT_BYTES,
+        LIMIT_SECONDS,
+        LIMIT_COUNT,
+};
+
+// A resource "limit" sets, by its name on the command line
+struct LimitName {
+        const char *name;
+        int resource;
+        enum LimitUnit unit;
+};
+
+// The I/O classes of ioprio_set
+enum {
+        IOPRIO_CLASS_RT = 1,
+        IOPRIO_CLASS_BE,
+        IOPRIO_CLASS_IDLE,
+};
+
+// What a command may use and where it runs, from its "limit" and "pin"
+// prefixes. The child applies them to itself before exec.
+// rlimits: the value for each of limit_names, set if its bit is in
+// rlimits_set
+// pinned, cpus: the CPUs it may run on
+// niced, nice: added to its niceness
+// ioprio: its I/O class and level, 0 to keep the shell's
+struct Limits {
+        rlim_t rlimits[MAX_LIMITS];
+        unsigned rlimits_set;
+        bool pinned;
+        cpu_set_t cpus;
+        bool niced;
+        int nice;
+        int ioprio;
+};
+
+// The launch plan of one child
+// actions: redirection plan applied before exec
+// pgid: process group to join, 0 to start a new one with the child's pid
+// limits: applied before exec, none when zeroed
+struct Launch {
+        struct FdAction actions[MAX_FD_ACTIONS];
+        int nactions;
+        pid_t pgid;
+        struct Limits limits;
+};
+
+// One entry of the command hash table
+// name: the command as typed
+// path: the absolute path found in $PATH
+// hits: how many times the entry was used
+struct HashEntry {
+        char *name;
+        char *path;
+        int hits;
+        struct HashEntry *next;
+};
+
+// How children are started
+// LAUNCH_SPAWN: posix_spawn, which glibc runs on clone(CLONE_VM|CLONE_VFORK)
+// LAUNCH_FORK: classic fork then exec
+// LAUNCH_ZYGOTE: asked to the zygote, a small launcher forked at startup
+enum LaunchMode {
+        LAUNCH_SPAWN,
+        LAUNCH_FORK,
+        LAUNCH_ZYGOTE,
+};
+
+// A launch request to the zygote. The path, the arguments and the
+// environment changes follow it, each ending with a '\0'. The
+// descriptors the plan copies are passed along with it (SCM_RIGHTS).
+// plan: the launch plan, where an FD_DUP source is the index of the
+// descriptor among the ones passed, MAX_FD_ACTIONS for one the plan
+// closed before
+// argc: number of arguments
+// nenv: number of environment changes, "NAME=value" to set it or "NAME"
+// to unset it
+// cwd: true when the shell's directory changed, its path comes last
+struct ZygoteRequest {
+        struct Launch plan;
+        int argc;
+        int nenv;
+        bool cwd;
+};
+
+// The zygote's answer: the pid of the child, or -1 and an errno
+struct ZygoteReply {
+        pid_t pid;
+        int error;
+};
+
+// A child of the zygote was reaped or stopped, as wait4 told the zygote
+struct ZygoteEvent {
+        pid_t pid;
+        int status;
+        struct rusage usage;
+};
+
+// Where command lines come from
+// fd: the file read from, -1 once the whole input is in data
+// data: the read buffer, or the whole input when it is mapped or given
+// with -c
+// size: size of data
+// len: number of bytes of input in data
+// pos: where the next line starts
+// mapped: data is an mmap of the script
+// tail: copy of a last line that has no '\n', to end it with '\0'
+struct Input {
+        int fd;
+        char *data;
+        size_t size;
+        size_t len;
+        size_t pos;
+        bool mapped;
+        char *tail;
+};
+
+// A command run by the shell itself
+// name: the command name
+// fn: runs the command and returns its exit status
+// utility: true for commands that stand in for an external program.
+// They can be pipeline stages, and report their status with
+// "+ completed" like the program would. The others change the shell's
+// own state, and only run on their own.
+// stage: a utility that only moves data between its stdin and stdout,
+// so that the shell can run it itself as a pipeline stage, alongside
+// the children running the other stages
+// takes: whether it runs these arguments, NULL if it runs any. The
+// external program runs the others.
+struct Builtin {
+        const char *name;
+        int (*fn)(struct Command *command);
+        bool utility;
+        bool stage;
+        bool (*takes)(struct Command *command);
+};
+
+// The shell's own descriptors, while a builtin runs with others in
+// their place
+// fds: the descriptors replaced
+// copies: copies of the shell's, -1 where it was closed
+// count: number of descriptors replaced
+// sigpipe: how SIGPIPE was handled before
+struct StdioSave {
+        int fds[MAX_FD_ACTIONS];
+        int copies[MAX_FD_ACTIONS];
+        int count;
+        struct sigaction sigpipe;
+};
+
+// The command history, mapped from its file. The index is built the
+// first time the history is searched, and extended as the file grows.
+// fd: the file, opened for appending, -1 without a history
+// data, mapped: the mapping and its size
+// lines: where each entry starts in the file
+// sigs: the history_sig of each entry, to skip most of them when
+// looking for a text
+// nsigs: number of entries whose signature was computed
+// count, cap: number of entries indexed and allocated
+// indexed: the bytes the entries cover
+// sorted: entries by text, only the latest of each distinct text
+// nsorted: number of them
+// latest: the latest entry of each HISTORY_BLOCK of sorted
+// sorted_upto: entries below it are in sorted, the later ones are not
+struct History {
+        int fd;
+        char *data;
+        size_t mapped;
+        size_t *lines;
+        uint64_t *sigs;
+        int nsigs;
+        int count;
+        int cap;
+        size_t indexed;
+        int *sorted;
+        int nsorted;
+        int *latest;
+        int sorted_upto;
 };
 
 // Error structure
@@ -43,487 +497,4759 @@ struct Error {
         char msg[CMDLINE_MAX];
 };
 
+const struct Builtin *find_builtin(struct Command *command);
+char *command_output(struct Arena *arena, const char *text, size_t len);
+void job_update(pid_t pid, int status, struct rusage *usage);
+bool zygote_start(void);
+const char *dir_top(void);
+void print_escape(const char **p);
+int glob_expand(struct Arena *arena, const char *pattern, struct GlobMatches *matches);
+long long parse_bytes(const char *text);
+
+// Set by -q, to leave out the "+ completed" lines
+static bool quiet;
+
+// Set by -t, to time every pipeline as if it started with "time"
+static bool time_all;
+
+// The exit status of the last pipeline, for $?
+static int last_status;
+
+// Set by "set pipesize=", the capacity of new pipes, 0 for the kernel's
+static int pipe_size;
+
+// The history, in a file shared by every session and only ever appended
+// to, one line per entry. Lines are added with a single write, so those
+// of sessions running at the same time do not mix.
+static struct History history = { .fd = -1 };
+
 void print_prompt(){
         printf("sshell$ ");
         fflush(stdout);
 }
 
-// split the command without files and pipes into tokens,
-// and put them in the Command struct.
-struct Error basic_command_split(struct Command *command, char *buffer) {
-        int counter = 0;
-        char *arg;
-        struct Error error;
+// Read from a file, in large blocks. A script that is a regular file is
+// mapped instead of read.
+void input_open_fd(struct Input *input, int fd) {
+        struct stat st;
 
-        command->cmd = strtok(buffer, " ");
-        command->args[counter] = command->cmd;
-        counter++;
-        
-        // reference:
-        // https://stackoverflow.com/questions/23456374/why-do-we-use-null-in-strtok
-        arg = strtok(NULL, " ");
-        while(arg) {
-                // Test if the argument are too much
-                if (counter >= MAX_ARGUMENT){
-                        error.flag = 1;
-                        strcpy(error.msg, "Error: too many process arguments\n");
-                        break;
+        memset(input, 0, sizeof(struct Input));
+        input->fd = fd;
+        if (fd != STDIN_FILENO && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                // private, so that the lines can be cut in place
+                input->data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                if (input->data != MAP_FAILED) {
+                        input->mapped = true;
+                        input->size = st.st_size;
+                        input->len = st.st_size;
+                        input->fd = -1;
+                        close(fd);
+                        return;
                 }
-                command->args[counter] = arg;
-                counter++;
-                arg = strtok(NULL, " ");
         }
-        if (error.flag != 1)
-                command->args[counter] = NULL;
-        return error;
+        input->size = INPUT_CHUNK;
+        input->data = malloc(input->size);
 }
 
-// Will be used when a '<' or '>' is detected in the command
-// Parse the command and put them into the Command structure
-struct Error extract_filename(struct Command *command, char *buffer) {
-        char *basic_command;
-        char *filename;
-        struct Error error;
+// Read the lines of a string, for -c
+void input_open_string(struct Input *input, char *string) {
+        memset(input, 0, sizeof(struct Input));
+        input->fd = -1;
+        input->data = string;
+        input->len = strlen(string);
+        input->size = input->len;
+}
 
-        if(strchr(buffer, '>')){
-                if (*buffer == '>'){
-                        error.flag = 1;
-                        strcpy(error.msg, "Error: missing command\n");
-                        return error;
-                }
-                basic_command = strtok(buffer, ">"); 
-                filename = strtok(NULL, ">");
-                filename = strtok(filename, " "); // make sure no space in filename
-                if (filename == NULL) {
-                        error.flag = 1;
-                        strcpy(error.msg, "no output file\n");
-                        return error;
-                }
-                command->filename = filename;
-                error = basic_command_split(command, basic_command);
-                if (command->cmd == NULL){
-                        error.flag = 1;
-                        strcpy(error.msg, "Error: missing command\n");
-                        return error;
+// Get the next line, without its '\n'. Returns NULL at the end of the
+// input. The line stays valid until the next call.
+char *input_read_line(struct Input *input) {
+        char *line;
+        char *nl;
+
+        while (1) {
+                line = input->data + input->pos;
+                nl = memchr(line, '\n', input->len - input->pos);
+                if (nl) {
+                        *nl = '\0';
+                        input->pos = nl - input->data + 1;
+                        return line;
                 }
-        } else if (strchr(buffer, '<')) {
-                basic_command = strtok(buffer, "<");
-                if (*buffer == '<'){
-                        error.flag = 1;
-                        strcpy(error.msg, "Error: missing command\n");
-                        return error;
+                if (input->fd == -1)
+                        break;
+
+                // keep the start of the line, and read more after it
+                ssize_t count;
+                if (input->pos > 0) {
+                        memmove(input->data, line, input->len - input->pos);
+                        input->len -= input->pos;
+                        input->pos = 0;
                 }
-                command->filename = strtok(NULL, "<");
-                filename = strtok(command->filename, " ");
-                if (filename == NULL) {
-                        error.flag = 1;
-                        strcpy(error.msg, "no input file\n");
-                        return error;
+                if (input->len == input->size) {
+                        input->size *= 2;
+                        input->data = realloc(input->data, input->size);
                 }
-                error = basic_command_split(command, basic_command);
-                if (command->cmd == NULL){
-                        error.flag = 1;
-                        strcpy(error.msg, "Error: missing command\n");
-                        return error;
+                count = read(input->fd, input->data + input->len, input->size - input->len);
+                if (count == -1 && errno == EINTR)
+                        continue;
+                if (count <= 0) {
+                        input->fd = -1;
+                        break;
                 }
-        } 
-        return error;
-}
+                input->len += count;
+        }
 
+        // the last line has no '\n'
+        if (input->pos == input->len)
+                return NULL;
+        free(input->tail);
+        input->tail = strndup(input->data + input->pos, input->len - input->pos);
+        input->pos = input->len;
+        return input->tail;
+}
 
-// Will be used if there is a pipe line
-struct Error pipe_split(struct Pipelines *pipeline, char *buffer, int *counter) {
-        char* nl;
-        char *basic_command[MAX_PIPES];
-        struct Error error;
+void arena_reset(struct Arena *arena) {
+        for (struct ArenaChunk *chunk = arena->head; chunk; chunk = chunk->next)
+                chunk->used = 0;
+        arena->cur = arena->head;
+}
 
-        nl = strchr(buffer, '\0');
+void *arena_alloc(struct Arena *arena, size_t size) {
+        struct ArenaChunk *chunk = arena->cur;
+        size_t align = sizeof(max_align_t);
+        void *ptr;
 
-        if ((*buffer == '|') || (*(nl-1) == '|')){
-                error.flag = 1;
-                strcpy(error.msg, "Error: missing command\n");
-                return error;
-        }
-        
-        basic_command[0] = strtok(buffer, "|");
-        for(*counter = 1; *counter < MAX_PIPES; (*counter)++){
-                basic_command[*counter] = strtok(NULL, "|");
+        size = (size + align - 1) & ~(align - 1);
+        while (chunk && chunk->used + size > chunk->size) {
+                chunk = chunk->next;
+                if (chunk)
+                        chunk->used = 0;
         }
-        
-        for(*counter = 0; *counter < MAX_PIPES; (*counter)++){
-                if (!basic_command[*counter]){
-                        break;
-                } 
-        }
-
-        for(int i = 0; i < *counter; i++){
-                if ((i != (*counter - 1)) && (strchr(basic_command[i], '<') || strchr(basic_command[i], '>'))) {
-                        error.flag = 1;
-                        strcpy(error.msg, "Error: mislocated output redirection\n");
-                        return error;
+        if (chunk == NULL) {
+                size_t chunk_size = ARENA_CHUNK;
+                if (arena->cur && arena->cur->size * 2 > chunk_size)
+                        chunk_size = arena->cur->size * 2;
+                if (size > chunk_size)
+                        chunk_size = size;
+                chunk = malloc(sizeof(struct ArenaChunk) + chunk_size);
+                if (chunk == NULL) {
+                        perror("malloc");
+                        exit(1);
                 }
-                pipeline->cmds[i] = malloc(sizeof(struct Command));
-                if (i == (*counter - 1) && strchr(basic_command[i], '>')){
-                        error = extract_filename(pipeline->cmds[i], basic_command[i]);
+                chunk->size = chunk_size;
+                chunk->used = 0;
+                // keep every chunk after the current one, so none is lost
+                if (arena->cur) {
+                        chunk->next = arena->cur->next;
+                        arena->cur->next = chunk;
                 } else {
-                        error = basic_command_split(pipeline->cmds[i], basic_command[i]);
+                        chunk->next = NULL;
+                        arena->head = chunk;
                 }
         }
-        return error;
+        arena->cur = chunk;
+        ptr = (char *)chunk->data + chunk->used;
+        chunk->used += size;
+        return ptr;
 }
 
+// Copy an array into a new one twice as big, the old one is left in the
+// arena until the next reset
+void *arena_grow(struct Arena *arena, void *old, size_t size) {
+        void *ptr = arena_alloc(arena, size * 2);
 
-struct Error run_command(struct Command *command, char *buffer){
-        int pid;
-        int fd;
-        int status;
-        struct Error error;
-        if (strchr(buffer, '<')) {
-                fd = open(command->filename, O_RDONLY);
-                if (fd == -1){
-                        error.flag = 1;
-                        strcpy(error.msg, "Error: cannot open input file\n");
-                        return error;
-                }
-        }
-        if (strchr(buffer, '>')) {
-                fd = open(command->filename, O_WRONLY);
-                if (fd == -1){
-                        error.flag = 1;
-                        strcpy(error.msg, "Error: cannot open output file\n");
-                        return error;
-                }
-        }
+        memcpy(ptr, old, size);
+        return ptr;
+}
 
-        pid = fork();
-        if (pid == 0) {
-                // child
-                if (strchr(buffer, '<')) {
-                        dup2(fd, STDIN_FILENO);
-                        close(fd);
-                }
-                if (strchr(buffer, '>')) {
-                        dup2(fd, STDOUT_FILENO);
-                        close(fd);
-                }
-                
-                execvp(command->cmd,command->args);
-                //perror("execv");
-                exit(1);
-        } else if (pid > 0){
-                // parent
-                wait(&status);
-                if(status != 0)
-                        fprintf(stderr, "Error: command not found\n");
-                fprintf(stderr, "+ completed \'%s\' [%d]\n", buffer, WEXITSTATUS(status));
-        } else {
-                perror("fork");
-                exit(1);
-        }
-        return error;
+void strbuf_init(struct StrBuf *buf, struct Arena *arena, size_t cap) {
+        buf->arena = arena;
+        buf->cap = cap + 1;
+        buf->len = 0;
+        buf->data = arena_alloc(arena, buf->cap);
+        buf->data[0] = '\0';
 }
 
-struct Node *reverse_list(struct Node *head) {
-        struct Node *front = NULL;
-        struct Node *back = NULL;
-        struct Node *cur = head;
-        while(cur) {
-                back = cur->next;
-                cur->next = front;
-                front = cur;
-                cur = back;
+void strbuf_add(struct StrBuf *buf, const char *data, size_t len) {
+        while (buf->len + len + 1 > buf->cap) {
+                buf->data = arena_grow(buf->arena, buf->data, buf->cap);
+                buf->cap *= 2;
         }
-        return front;
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+        buf->data[buf->len] = '\0';
 }
-void print_dirs(struct Node *head) {
-        struct Node* start = reverse_list(head);
-        if(head == NULL) {
-                fprintf(stdout, "\n");
-                return;
-        }
-        while(start != NULL) {
-                fprintf(stdout, "%s\n", start->curstack);
-                start = start->next;
-        }
+
+void strbuf_addc(struct StrBuf *buf, char c) {
+        strbuf_add(buf, &c, 1);
 }
-struct Node *pushd(struct Node *newNode, struct Node *head) {
-        struct Node *pushNode = head;
-        if (pushNode == NULL) {
-                return newNode;
-        }
-        else {
-                pushNode->next = pushd(newNode, (pushNode->next));
-                return pushNode;
-        }
+
+// Characters that end an unquoted word
+bool is_meta(char c) {
+        return c == '\0' || c == ' ' || c == '\t' || c == '|' || c == '<' || c == '>' ||
+                c == '&' || c == ';';
 }
-struct Node *popd(struct Node *head) {
-        if (head == NULL) {
-                return head;
-        }
-        else if(head->next == NULL) { //found the last node on stack
-                return NULL;
+
+// Find the ')' closing a "$(", given its '('. Quotes and nested
+// parentheses inside are skipped. Returns NULL if it is not closed.
+const char *subst_end(const char *p) {
+        int depth = 0;
+
+        for (; *p; p++) {
+                if (*p == '\\' && p[1]) {
+                        p++;
+                } else if (*p == '\'' || *p == '"') {
+                        char quote = *p;
+                        for (p++; *p && *p != quote; p++) {
+                                if (quote == '"' && *p == '\\' && p[1])
+                                        p++;
+                        }
+                        if (*p == '\0')
+                                return NULL;
+                } else if (*p == '(') {
+                        depth++;
+                } else if (*p == ')' && --depth == 0) {
+                        return p;
+                }
         }
-        else {
-                head->next = popd(head->next);
-                return head;
+        return NULL;
+}
+
+// Read one word as typed, quotes included. Quotes are removed when the
+// word is expanded, just before its command runs. A "$(...)" is part of
+// the word, whatever it holds.
+enum TokenKind lex_word(struct Lexer *lex, char **word, struct Error *error) {
+        const char *start = lex->pos;
+        const char *p = start;
+
+        while (!is_meta(*p)) {
+                char quote = *p;
+                if (quote == '\'' || quote == '"') {
+                        for (p++; *p && *p != quote; p++) {
+                                if (quote == '"' && *p == '$' && p[1] == '(') {
+                                        p = subst_end(p + 1);
+                                        if (p == NULL)
+                                                break;
+                                }
+                                if (quote == '"' && *p == '\\' && p[1])
+                                        p++;
+                        }
+                        if (p == NULL || *p == '\0') {
+                                error->flag = 1;
+                                strcpy(error->msg, "Error: unterminated quote\n");
+                                return TOK_ERROR;
+                        }
+                } else if (quote == '$' && p[1] == '(') {
+                        p = subst_end(p + 1);
+                        if (p == NULL) {
+                                error->flag = 1;
+                                strcpy(error->msg, "Error: unterminated command substitution\n");
+                                return TOK_ERROR;
+                        }
+                } else if (quote == '\\' && p[1]) {
+                        p++;
+                }
+                p++;
         }
+        lex->pos = p;
+
+        *word = arena_alloc(lex->arena, p - start + 1);
+        memcpy(*word, start, p - start);
+        (*word)[p - start] = '\0';
+        return TOK_WORD;
 }
-void changeDir(struct Command command, char cwd[]) {
-        char curdirectory[CMDLINE_MAX];
-        if (command.args[1] == NULL) {
-                sprintf(curdirectory, "%s", getenv("HOME"));
-                chdir(curdirectory);
+
+// Read the next token of the line
+enum TokenKind next_token(struct Lexer *lex, char **word, struct Error *error) {
+        while (*lex->pos == ' ' || *lex->pos == '\t')
+                lex->pos++;
+
+        // a single digit right before '<' or '>' is the fd they redirect
+        lex->fd = -1;
+        if (*lex->pos >= '0' && *lex->pos <= '9' && (lex->pos[1] == '<' || lex->pos[1] == '>')) {
+                lex->fd = *lex->pos - '0';
+                lex->pos++;
         }
-        else if (command.args[2] != NULL) {
-                fprintf(stderr, "err: Failed to cd, incorrect number of arguments.\n");
+
+        switch (*lex->pos) {
+        case '\0':
+                return TOK_END;
+        case '|':
+                lex->pos++;
+                if (*lex->pos == '|') {
+                        lex->pos++;
+                        return TOK_OR;
+                }
+                return TOK_PIPE;
+        case '<':
+                lex->pos++;
+                if (*lex->pos == '<') {
+                        lex->pos++;
+                        if (*lex->pos == '<') {
+                                lex->pos++;
+                                return TOK_HERE_STRING;
+                        }
+                        return TOK_HERE_DOC;
+                }
+                if (*lex->pos == '&') {
+                        lex->pos++;
+                        return TOK_DUP_IN;
+                }
+                return TOK_IN;
+        case '>':
+                lex->pos++;
+                if (*lex->pos == '>') {
+                        lex->pos++;
+                        return TOK_APPEND;
+                }
+                if (*lex->pos == '&') {
+                        lex->pos++;
+                        return TOK_DUP_OUT;
+                }
+                return TOK_OUT;
+        case '&':
+                lex->pos++;
+                if (*lex->pos == '&') {
+                        lex->pos++;
+                        return TOK_AND;
+                }
+                return TOK_AMP;
+        case ';':
+                lex->pos++;
+                return TOK_SEMI;
+        default:
+                return lex_word(lex, word, error);
         }
-        else if (!strcmp(command.args[1], "..")) {
-                chdir("..");
+}
+
+bool is_redirect(enum TokenKind kind) {
+        return kind == TOK_IN || kind == TOK_HERE_STRING || kind == TOK_HERE_DOC ||
+                kind == TOK_DUP_IN || kind == TOK_OUT || kind == TOK_APPEND || kind == TOK_DUP_OUT;
+}
+
+// Parse the word after a redirection operator, and add the redirection
+// to the command. cap is the number of redirections allocated.
+struct Error parse_redirect(struct Lexer *lex, struct Command *command, enum TokenKind kind, int *cap) {
+        struct Error error = {0};
+        bool output = kind == TOK_OUT || kind == TOK_APPEND || kind == TOK_DUP_OUT;
+        struct Redirect *redir;
+        int fd = lex->fd;
+        char *word;
+
+        if (next_token(lex, &word, &error) != TOK_WORD) {
+                if (error.flag == 1)
+                        return error;
+                error.flag = 1;
+                if (output)
+                        strcpy(error.msg, "Error: no output file\n");
+                else
+                        strcpy(error.msg, "Error: no input file\n");
+                return error;
         }
-        else if (!strcmp(command.args[1], "~")) {
-                sprintf(curdirectory, "%s", getenv("HOME"));
-                chdir(curdirectory);
+        // the pipes take two actions of the launch plan
+        if (command->nredirs + 2 == MAX_FD_ACTIONS) {
+                error.flag = 1;
+                strcpy(error.msg, "Error: too many redirections\n");
+                return error;
         }
-        else if (!strcmp(command.args[1], "/")) {
-                sprintf(curdirectory, "%s", getenv("ROOT"));
-                chdir(curdirectory);
+        if (command->nredirs == *cap) {
+                command->redirs = arena_grow(lex->arena, command->redirs, *cap * sizeof(struct Redirect));
+                *cap *= 2;
         }
-        else {
-                //getcwd(cwd, sizeof(cwd));
-                strcat(cwd, "/");
-                strcat(cwd, command.args[1]);
-                if (chdir(command.args[1]) == FAIL_CD) {
-                        fprintf(stderr, "Directory not found: %s\n", command.args[1]);
-                        return;
+        redir = &command->redirs[command->nredirs++];
+        redir->fd = fd != -1 ? fd : output ? STDOUT_FILENO : STDIN_FILENO;
+        redir->word = word;
+        redir->opened = -1;
+        switch (kind) {
+        case TOK_IN:
+                redir->kind = REDIR_OPEN;
+                redir->flags = O_RDONLY;
+                break;
+        case TOK_OUT:
+                redir->kind = REDIR_OPEN;
+                redir->flags = O_WRONLY | O_CREAT | O_TRUNC;
+                break;
+        case TOK_APPEND:
+                redir->kind = REDIR_OPEN;
+                redir->flags = O_WRONLY | O_CREAT | O_APPEND;
+                break;
+        case TOK_HERE_STRING:
+                redir->kind = REDIR_HERE_STRING;
+                break;
+        case TOK_HERE_DOC:
+                redir->kind = REDIR_HERE_DOC;
+                break;
+        default:
+                // '<&' or '>&': a descriptor, or '-' to close
+                if (!strcmp(word, "-")) {
+                        redir->kind = REDIR_CLOSE;
+                        break;
                 }
-                else {
-                        chdir(cwd);
+                redir->kind = REDIR_DUP;
+                redir->target = 0;
+                for (char *p = word; *p; p++) {
+                        if (*p < '0' || *p > '9' || redir->target > INT_MAX / 10 - 1) {
+                                error.flag = 1;
+                                strcpy(error.msg, "Error: bad file descriptor\n");
+                                return error;
+                        }
+                        redir->target = redir->target * 10 + (*p - '0');
                 }
         }
+        return error;
 }
 
-int main(void)
-{
-        char buffer[CMDLINE_MAX];
-        char buffercpy[CMDLINE_MAX];
-        struct Node *head_out = (struct Node*)malloc(sizeof(struct Node)); //head of directory stack
-        /*char cwd_out[MAX_TOKEN_LEN];
-        getcwd(cwd_out, sizeof(cwd_out));
-        strcpy(head->curstack, cwd_out);
-        head-> next = NULL;*/
-        static bool once = true;
-
+// Parse one command, up to the next operator or the end of the line.
+// kind is set to the token that ended it.
+struct Error parse_command(struct Lexer *lex, struct Command *command, enum TokenKind *kind) {
+        struct Error error = {0};
+        int cap = 8;
+        int redirs_cap = 2;
+        char *word;
 
+        memset(command, 0, sizeof(struct Command));
+        command->args = arena_alloc(lex->arena, cap * sizeof(char *));
+        command->redirs = arena_alloc(lex->arena, redirs_cap * sizeof(struct Redirect));
         while (1) {
-                char *nl;  // Is used in replacing \n with \0
-                char *fileinindex;  // Is used to store the pointer of '<' in command
-                char *fileoutindex; // Is used to store the pointer of '>' in command
-                // int retval;
-                char cwd[MAX_TOKEN_LEN]; // Is used to store the directory address
-                pid_t pid; // Is used to store the child's PID
-                struct Command command; // Command variable when no pipe
-                int status; // Store child's return value
-                int pipeCounter = 0;
-                struct Error error;
-                
-                //struct Node *head = (struct Node*)malloc(sizeof(struct Node)); //head of directory stack
-                if (once) {
-                        once = false;
-                        getcwd(cwd, sizeof(cwd));
-                        strcpy(head_out->curstack, cwd);
-                        head_out-> next = NULL;
+                *kind = next_token(lex, &word, &error);
+                if (*kind == TOK_WORD) {
+                        if (command->argc + 1 == cap) {
+                                command->args = arena_grow(lex->arena, command->args, cap * sizeof(char *));
+                                cap *= 2;
+                        }
+                        command->args[command->argc++] = word;
+                } else if (is_redirect(*kind)) {
+                        error = parse_redirect(lex, command, *kind, &redirs_cap);
+                        if (error.flag == 1)
+                                return error;
+                } else {
+                        break;
                 }
+        }
+        if (error.flag == 1)
+                return error;
+        command->args[command->argc] = NULL;
+        command->cmd = command->args[0];
+        return error;
+}
 
-                /* Print prompt */
-                print_prompt();
-
-                /* Get command line */
-                fgets(buffer, CMDLINE_MAX, stdin);
-                strcpy(buffercpy, buffer);
+// Parse one pipeline, up to the next ';', '&', '&&', '||' or the end of
+// the line. kind is set to the token that ended it.
+struct Error parse_pipeline(struct Lexer *lex, struct Pipelines *pipeline, enum TokenKind *kind) {
+        struct Arena *arena = lex->arena;
+        struct Error error = {0};
+        const char *start;
+        const char *end;
+        int cap = 4;
 
-                /* Print command line if stdin is not provided by terminal */
-                if (!isatty(STDIN_FILENO)) {
-                        printf("%s", buffer);
-                        fflush(stdout);
-                }
+        while (*lex->pos == ' ' || *lex->pos == '\t')
+                lex->pos++;
+        start = lex->pos;
 
-                /* Remove trailing newline from command line */
-                nl = strchr(buffer, '\n');
-                if (nl)
-                        *nl = '\0';
-                
-                nl = strchr(buffercpy, '\n');
-                if (nl)
-                        *nl = '\0';
+        pipeline->count = 0;
+        pipeline->background = false;
+        pipeline->cmds = arena_alloc(arena, cap * sizeof(struct Command));
+        do {
+                struct Command *command;
 
-                /* Builtin command */
-                if (!strcmp(buffer, "exit")) {
-                        fprintf(stderr, "Bye...\n");
-                        fprintf(stderr, "+ completed 'exit' [0]\n");
-                        break;
+                if (pipeline->count == cap) {
+                        pipeline->cmds = arena_grow(arena, pipeline->cmds, cap * sizeof(struct Command));
+                        cap *= 2;
                 }
-                // pwd
-                if (!strcmp(buffer, "pwd")) {
-                        if(getcwd(cwd, sizeof(cwd)) == NULL) {
-                                fprintf(stderr, "Fail to get the current working file\n");
-                                continue;
-                        } else {
-                                fprintf(stdout, "%s\n", cwd);
-                                continue;
+                command = &pipeline->cmds[pipeline->count++];
+                end = lex->pos;
+                error = parse_command(lex, command, kind);
+                if (error.flag == 1)
+                        return error;
+                if (command->argc == 0) {
+                        if (*kind == TOK_END && pipeline->count == 1 &&
+                            command->nredirs == 0) {
+                                pipeline->count = 0;
+                                return error;
                         }
+                        error.flag = 1;
+                        strcpy(error.msg, "Error: missing command\n");
+                        return error;
                 }
-                //cd
-                basic_command_split(&command, buffercpy);
-                if (!strcmp(command.args[0], "cd")) {
-                        getcwd(cwd, sizeof(cwd));
-                        changeDir(command, cwd);
-                        continue;
-                }
-                strcpy(buffercpy, buffer);
+        } while (*kind == TOK_PIPE);
 
-                //directory stack
-                if (!strcmp(command.args[0], "pushd")) {
-                        if (chdir(command.args[1]) == FAIL_CD) {
-                                fprintf(stderr, "Directory not found: %s\n", command.args[1]);
-                                continue;
-                        }
-                        strcpy(cwd, head_out->curstack);
-                        strcat(cwd, "/");
-                        strcat(cwd, command.args[1]);
-                        struct Node *newNode = (struct Node*)malloc(sizeof(struct Node));
-                        strcpy(newNode->curstack, cwd);
-                        newNode->next = NULL;
-                        head_out = pushd(newNode, head_out);
-                        continue;
+        // the text ends before the operator, but keeps a '&'
+        end = lex->pos;
+        if (*kind == TOK_AMP) {
+                pipeline->background = true;
+        } else if (*kind == TOK_AND || *kind == TOK_OR) {
+                end -= 2;
+        } else if (*kind == TOK_SEMI) {
+                end -= 1;
+        }
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+                end--;
+        pipeline->text = arena_alloc(arena, end - start + 1);
+        memcpy(pipeline->text, start, end - start);
+        pipeline->text[end - start] = '\0';
+
+        pipeline->pipes = arena_alloc(arena, pipeline->count * sizeof(int[2]));
+        pipeline->pids = arena_alloc(arena, pipeline->count * sizeof(pid_t));
+        pipeline->status = arena_alloc(arena, pipeline->count * sizeof(int));
+        memset(pipeline->status, 0, pipeline->count * sizeof(int));
+        pipeline->usage = arena_alloc(arena, pipeline->count * sizeof(struct StageUsage));
+        memset(pipeline->usage, 0, pipeline->count * sizeof(struct StageUsage));
+        pipeline->timed = false;
+        pipeline->pipesize = 0;
+        return error;
+}
+
+// Parse the whole line into a list of pipelines in a single pass. An
+// empty line gives a list with no pipeline.
+struct Error parse_line(struct Arena *arena, const char *line, struct CommandList *list) {
+        struct Lexer lex = { .pos = line, .arena = arena };
+        struct Error error = {0};
+        enum TokenKind kind = TOK_SEMI;
+        int cap = 4;
+
+        list->count = 0;
+        list->pipelines = arena_alloc(arena, cap * sizeof(struct Pipelines));
+        while (1) {
+                struct Pipelines *pipeline;
+                enum ListOp op = kind == TOK_AND ? LIST_AND :
+                        kind == TOK_OR ? LIST_OR : LIST_SEQ;
+
+                if (list->count == cap) {
+                        list->pipelines = arena_grow(arena, list->pipelines, cap * sizeof(struct Pipelines));
+                        cap *= 2;
                 }
-                if (!strcmp(command.args[0], "popd")) {
-                        if (head_out->next == NULL) {
-                                fprintf(stdout, "Unable to pop\n");
-                        }
-                        else {
-                                head_out = popd(head_out);
-                                chdir("..");
+                pipeline = &list->pipelines[list->count];
+                error = parse_pipeline(&lex, pipeline, &kind);
+                if (error.flag == 1)
+                        return error;
+                if (pipeline->count == 0) {
+                        // nothing after the last ';' or '&' is fine
+                        if (op != LIST_SEQ || (list->count == 0 && kind != TOK_END)) {
+                                error.flag = 1;
+                                strcpy(error.msg, "Error: missing command\n");
                         }
-                        continue;
-                }
-                if (!strcmp(command.args[0], "dirs")) {
-                        print_dirs(head_out);
-                        continue;
+                        return error;
                 }
+                pipeline->op = op;
+                list->count++;
+                if (kind == TOK_END)
+                        return error;
+        }
+}
 
-                // not built in
-                if(!strchr(buffer, '|')) {
-                        // normal case, no pipe
-
-                        // test if there is a file that need.
-                        fileinindex = strchr(buffer, '<');
-                        fileoutindex = strchr(buffer, '>');
-                        
-                        if (!(fileinindex||fileoutindex)){
-                                // the command has no file;
-                                //printf("n %s\n", buffer);
-                                error = basic_command_split(&command, buffercpy);
-                                //printf("%s\n", command.cmd);
-                                //printf("%s\n", command.args[0]);
-                                
-                        } else {
-                                // the command contains a file;
-                                error = extract_filename(&command, buffercpy);
-                                //printf("f %s\n", buffer);
-                        }
-                        // run the command
-                        if (error.flag == 1){
-                                fprintf(stderr, "%s", error.msg);
-                                continue;
-                        } else {
-                                error = run_command(&command, buffer);
-                                if (error.flag == 1) {
-                                        fprintf(stderr, "%s", error.msg);
+// Add one character of a word being expanded. The pattern gets it too,
+// escaped when it is quoted and would otherwise be a glob character.
+void expand_addc(struct StrBuf *buf, struct StrBuf *pattern, char c, bool quoted) {
+        strbuf_addc(buf, c);
+        if (quoted && strchr("*?[]\\", c))
+                strbuf_addc(pattern, '\\');
+        strbuf_addc(pattern, c);
+}
+
+// An unquoted '*', '?' or '[...]' makes a word a glob pattern
+bool is_glob_char(const char *p) {
+        return *p == '*' || *p == '?' || (*p == '[' && strchr(p + 1, ']'));
+}
+
+void fields_add(struct Arena *arena, struct GlobMatches *fields, char *word) {
+        if (fields->count == fields->cap) {
+                fields->paths = arena_grow(arena, fields->paths, fields->cap * sizeof(char *));
+                fields->cap *= 2;
+        }
+        fields->paths[fields->count++] = word;
+}
+
+// End a field: a glob pattern becomes the paths it matches, or stays
+// as it is if there is none
+void field_end(struct Arena *arena, char *word, char *pattern, struct GlobMatches *fields) {
+        if (pattern && glob_expand(arena, pattern, fields) > 0)
+                return;
+        fields_add(arena, fields, word);
+}
+
+// Expand one word: remove its quotes and replace $? with the status of
+// the last pipeline and $(...) with what its commands print. Inside
+// '...' every character is kept as it is, inside "..." a backslash only
+// escapes '"', '\' and '$', and outside quotes a backslash escapes any
+// character.
+// With fields, the word is added to them, split where an unquoted
+// $(...) printed blanks, and each part that has unquoted glob
+// characters is replaced by the paths it matches. Without, the word is
+// returned as one string.
+char *expand_word(struct Arena *arena, char *word, struct GlobMatches *fields) {
+        struct StrBuf buf, pat;
+        char status[16];
+        bool glob = false;
+        bool started = false;
+
+        // most words have nothing to expand
+        if (strpbrk(word, "'\"\\$") == NULL) {
+                for (char *p = word; fields && *p && !glob; p++)
+                        glob = is_glob_char(p);
+                if (fields)
+                        field_end(arena, word, glob ? word : NULL, fields);
+                return word;
+        }
+
+        snprintf(status, sizeof(status), "%d", last_status);
+        strbuf_init(&buf, arena, strlen(word));
+        strbuf_init(&pat, arena, strlen(word));
+        for (char *p = word; *p; p++) {
+                started = true;
+                if (*p == '\'') {
+                        for (p++; *p != '\''; p++)
+                                expand_addc(&buf, &pat, *p, true);
+                } else if (*p == '"') {
+                        for (p++; *p != '"'; p++) {
+                                if (*p == '$' && p[1] == '?') {
+                                        strbuf_add(&buf, status, strlen(status));
+                                        strbuf_add(&pat, status, strlen(status));
+                                        p++;
+                                        continue;
+                                }
+                                if (*p == '$' && p[1] == '(') {
+                                        const char *end = subst_end(p + 1);
+                                        char *out = command_output(arena, p + 2, end - p - 2);
+
+                                        for (char *c = out; *c; c++)
+                                                expand_addc(&buf, &pat, *c, true);
+                                        p = (char *)end;
+                                        continue;
+                                }
+                                if (*p == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$'))
+                                        p++;
+                                expand_addc(&buf, &pat, *p, true);
+                        }
+                } else if (*p == '$' && p[1] == '?') {
+                        strbuf_add(&buf, status, strlen(status));
+                        strbuf_add(&pat, status, strlen(status));
+                        p++;
+                } else if (*p == '$' && p[1] == '(') {
+                        const char *end = subst_end(p + 1);
+                        char *out = command_output(arena, p + 2, end - p - 2);
+
+                        // nothing is started until something is printed
+                        started = buf.len > 0;
+                        for (char *c = out; *c; c++) {
+                                if (fields && (*c == ' ' || *c == '\t' || *c == '\n')) {
+                                        if (started) {
+                                                field_end(arena, buf.data, glob ? pat.data : NULL, fields);
+                                                strbuf_init(&buf, arena, 16);
+                                                strbuf_init(&pat, arena, 16);
+                                                glob = false;
+                                                started = false;
+                                        }
+                                        continue;
+                                }
+                                expand_addc(&buf, &pat, *c, true);
+                                started = true;
+                        }
+                        p = (char *)end;
+                        if (!started && p[1] == '\0')
+                                break;
+                } else if (*p == '\\' && p[1]) {
+                        p++;
+                        expand_addc(&buf, &pat, *p, true);
+                } else {
+                        if (is_glob_char(p))
+                                glob = true;
+                        expand_addc(&buf, &pat, *p, false);
+                }
+        }
+        if (fields && started)
+                field_end(arena, buf.data, glob ? pat.data : NULL, fields);
+        return buf.data;
+}
+
+// Read the lines of a '<<' document, up to its end line, into the arena
+char *input_read_doc(struct Input *input, struct Arena *arena, char *end, bool interactive) {
+        struct StrBuf body;
+        char *line;
+
+        strbuf_init(&body, arena, 256);
+        while (1) {
+                if (interactive) {
+                        printf("> ");
+                        fflush(stdout);
+                }
+                line = input_read_line(input);
+                if (line == NULL || !strcmp(line, end))
+                        break;
+                strbuf_add(&body, line, strlen(line));
+                strbuf_addc(&body, '\n');
+        }
+        return body.data;
+}
+
+// Read the '<<' documents of a parsed line, which follow it in the input
+void input_read_here(struct Input *input, struct Arena *arena, struct CommandList *list,
+                     bool interactive) {
+        for (int i = 0; i < list->count; i++) {
+                for (int j = 0; j < list->pipelines[i].count; j++) {
+                        struct Command *command = &list->pipelines[i].cmds[j];
+
+                        for (int k = 0; k < command->nredirs; k++) {
+                                struct Redirect *redir = &command->redirs[k];
+                                if (redir->kind == REDIR_HERE_DOC)
+                                        redir->word = input_read_doc(input, arena,
+                                                expand_word(arena, redir->word, NULL), interactive);
+                        }
+                }
+        }
+}
+
+// Recent directory listings, for glob patterns
+static struct DirCache dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_cache_clock;
+
+// Read a directory into a cache entry, in one pass of getdents64 over
+// a large buffer. The d_type of each entry is kept, so most patterns
+// never stat an entry.
+bool dir_read(struct DirCache *entry, int fd) {
+        static char dents[DENTS_BUF];
+        ssize_t count;
+
+        entry->len = 0;
+        while ((count = getdents64(fd, dents, sizeof(dents))) > 0) {
+                for (ssize_t off = 0; off < count; ) {
+                        struct dirent64 *dent = (struct dirent64 *)(dents + off);
+                        size_t len = strlen(dent->d_name);
+
+                        off += dent->d_reclen;
+                        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+                                continue;
+                        if (entry->len + len + 2 > entry->cap) {
+                                entry->cap = entry->cap ? entry->cap * 2 : DENTS_BUF;
+                                if (entry->len + len + 2 > entry->cap)
+                                        entry->cap = entry->len + len + 2;
+                                entry->names = realloc(entry->names, entry->cap);
+                        }
+                        entry->names[entry->len] = dent->d_type;
+                        memcpy(entry->names + entry->len + 1, dent->d_name, len + 1);
+                        entry->len += len + 2;
+                }
+        }
+        return count == 0;
+}
+
+// Get the listing of a directory, from the cache when the directory is
+// the same and was not changed since. A directory changed in the same
+// second as it was read may have been changed after, within the mtime's
+// precision, so it is read again the next time.
+struct DirCache *dir_list(const char *path) {
+        struct DirCache *entry = NULL;
+        struct stat st;
+        int fd;
+
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1 || fstat(fd, &st) == -1) {
+                if (fd != -1)
+                        close(fd);
+                return NULL;
+        }
+        for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+                struct DirCache *e = &dir_cache[i];
+                if (e->path && !strcmp(e->path, path)) {
+                        entry = e;
+                        break;
+                }
+                if (entry == NULL || e->used < entry->used)
+                        entry = e;
+        }
+        entry->used = ++dir_cache_clock;
+        if (entry->path && !strcmp(entry->path, path) &&
+            entry->dev == st.st_dev && entry->ino == st.st_ino &&
+            entry->mtime.tv_sec == st.st_mtim.tv_sec &&
+            entry->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+            entry->read_at > st.st_mtim.tv_sec) {
+                close(fd);
+                return entry;
+        }
+
+        if (entry->path == NULL || strcmp(entry->path, path)) {
+                free(entry->path);
+                entry->path = strdup(path);
+        }
+        entry->dev = st.st_dev;
+        entry->ino = st.st_ino;
+        entry->mtime = st.st_mtim;
+        entry->read_at = time(NULL);
+        if (!dir_read(entry, fd)) {
+                free(entry->path);
+                entry->path = NULL;
+                entry = NULL;
+        }
+        close(fd);
+        return entry;
+}
+
+void glob_add(struct Arena *arena, struct GlobMatches *matches, const char *path, size_t len) {
+        char *copy = arena_alloc(arena, len + 1);
+
+        memcpy(copy, path, len);
+        copy[len] = '\0';
+        fields_add(arena, matches, copy);
+}
+
+// Match what is left of a pattern under path, which holds the len bytes
+// matched so far. A component without glob characters is only added to
+// the path, and checked with lstat at the end. A component with some
+// is matched against the listing of the directory. An entry is only
+// stat'ed when the pattern goes on below it and its d_type does not
+// tell whether it is a directory.
+void glob_walk(struct Arena *arena, char *path, size_t len, const char *pattern,
+               struct GlobMatches *matches) {
+        const char *slash = strchr(pattern, '/');
+        size_t seglen = slash ? (size_t)(slash - pattern) : strlen(pattern);
+        char segment[NAME_MAX * 2 + 1];
+        struct DirCache *dir;
+        bool glob = false;
+        struct stat st;
+
+        if (*pattern == '\0') {
+                // the pattern ended with '/'
+                glob_add(arena, matches, path, len);
+                return;
+        }
+        if (seglen >= sizeof(segment))
+                return;
+        memcpy(segment, pattern, seglen);
+        segment[seglen] = '\0';
+        if (slash)
+                while (*slash == '/')
+                        slash++;
+        for (char *p = segment; *p && !glob; p++) {
+                if (*p == '\\' && p[1])
+                        p++;
+                else
+                        glob = is_glob_char(p);
+        }
+
+        if (!glob) {
+                for (char *p = segment; *p; p++) {
+                        if (*p == '\\' && p[1])
+                                p++;
+                        if (len + 2 >= PATH_MAX)
+                                return;
+                        path[len++] = *p;
+                }
+                if (slash) {
+                        path[len++] = '/';
+                        glob_walk(arena, path, len, slash, matches);
+                } else {
+                        path[len] = '\0';
+                        if (lstat(path, &st) == 0)
+                                glob_add(arena, matches, path, len);
+                }
+                return;
+        }
+
+        path[len] = '\0';
+        dir = dir_list(len ? path : ".");
+        if (dir == NULL)
+                return;
+        // the cache entry may be replaced further down, so this level
+        // walks its own copy of the names
+        size_t names_len = dir->len;
+        char *names = malloc(names_len);
+        memcpy(names, dir->names, names_len);
+        for (size_t off = 0; off < names_len; ) {
+                unsigned char type = names[off];
+                char *name = names + off + 1;
+                size_t namelen = strlen(name);
+
+                off += namelen + 2;
+                if (fnmatch(segment, name, FNM_PERIOD) != 0)
+                        continue;
+                if (len + namelen + 2 >= PATH_MAX)
+                        continue;
+                memcpy(path + len, name, namelen + 1);
+                if (slash == NULL) {
+                        glob_add(arena, matches, path, len + namelen);
+                        continue;
+                }
+                if (type != DT_DIR) {
+                        if (type != DT_LNK && type != DT_UNKNOWN)
+                                continue;
+                        if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+                                continue;
+                }
+                path[len + namelen] = '/';
+                glob_walk(arena, path, len + namelen + 1, slash, matches);
+        }
+        free(names);
+}
+
+int glob_compare(const void *a, const void *b) {
+        return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Add the paths a glob pattern matches to matches, sorted. Returns how
+// many there were.
+int glob_expand(struct Arena *arena, const char *pattern, struct GlobMatches *matches) {
+        char path[PATH_MAX];
+        size_t len = 0;
+        int first = matches->count;
+
+        if (*pattern == '/') {
+                path[len++] = '/';
+                while (*pattern == '/')
+                        pattern++;
+        }
+        glob_walk(arena, path, len, pattern, matches);
+        qsort(matches->paths + first, matches->count - first, sizeof(char *), glob_compare);
+        return matches->count - first;
+}
+
+// Expand every word of a pipeline, right before it runs. A word can
+// become several arguments, or none.
+void expand_pipeline(struct Arena *arena, struct Pipelines *pipeline) {
+        for (int i = 0; i < pipeline->count; i++) {
+                struct Command *command = &pipeline->cmds[i];
+                struct GlobMatches args;
+
+                args.cap = command->argc + 1;
+                args.count = 0;
+                args.paths = arena_alloc(arena, args.cap * sizeof(char *));
+                for (int j = 0; j < command->argc; j++)
+                        expand_word(arena, command->args[j], &args);
+                fields_add(arena, &args, NULL);
+                command->args = args.paths;
+                command->argc = args.count - 1;
+                command->cmd = command->args[0];
+                for (int j = 0; j < command->nredirs; j++) {
+                        struct Redirect *redir = &command->redirs[j];
+                        if (redir->kind == REDIR_OPEN || redir->kind == REDIR_HERE_STRING)
+                                redir->word = expand_word(arena, redir->word, NULL);
+                }
+        }
+}
+
+// Command hash table, filled on first use of a command and cleared
+// whenever $PATH is not the one it was filled from
+static struct HashEntry *hash_table[HASH_BUCKETS];
+static char *hash_path_env;
+
+unsigned hash_index(const char *name) {
+        unsigned h = 5381;
+
+        while (*name)
+                h = h * 33 + (unsigned char)*name++;
+        return h % HASH_BUCKETS;
+}
+
+void hash_clear(void) {
+        for (int i = 0; i < HASH_BUCKETS; i++) {
+                struct HashEntry *entry = hash_table[i];
+                while (entry) {
+                        struct HashEntry *next = entry->next;
+                        free(entry->name);
+                        free(entry->path);
+                        free(entry);
+                        entry = next;
+                }
+                hash_table[i] = NULL;
+        }
+}
+
+// Drop the table if $PATH changed since it was filled
+void hash_check_path(void) {
+        char *path_env = getenv("PATH");
+
+        if (path_env == NULL)
+                path_env = "";
+        if (hash_path_env && !strcmp(hash_path_env, path_env))
+                return;
+        hash_clear();
+        free(hash_path_env);
+        hash_path_env = strdup(path_env);
+}
+
+void hash_forget(const char *name) {
+        struct HashEntry **link = &hash_table[hash_index(name)];
+
+        while (*link) {
+                struct HashEntry *entry = *link;
+                if (!strcmp(entry->name, name)) {
+                        *link = entry->next;
+                        free(entry->name);
+                        free(entry->path);
+                        free(entry);
+                        return;
+                }
+                link = &entry->next;
+        }
+}
+
+// Search every $PATH directory for an executable file called name.
+// Returns a malloced path, or NULL if there is none.
+char *path_search(const char *name) {
+        const char *dir = hash_path_env;
+        size_t namelen = strlen(name);
+
+        while (dir) {
+                const char *colon = strchr(dir, ':');
+                size_t dirlen = colon ? (size_t)(colon - dir) : strlen(dir);
+                char *path = malloc(dirlen + namelen + 3);
+                struct stat st;
+
+                if (dirlen == 0) {
+                        // an empty entry means the current directory
+                        strcpy(path, "./");
+                } else {
+                        memcpy(path, dir, dirlen);
+                        strcpy(path + dirlen, "/");
+                }
+                strcat(path, name);
+                if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+                        return path;
+                free(path);
+                dir = colon ? colon + 1 : NULL;
+        }
+        return NULL;
+}
+
+// Resolve a command name to the path it is executed from.
+// Names containing a '/' are used as they are. Returns NULL if the
+// command is not found.
+const char *resolve_command(const char *name) {
+        struct HashEntry *entry;
+        unsigned index;
+        char *path;
+
+        if (strchr(name, '/'))
+                return name;
+
+        hash_check_path();
+        index = hash_index(name);
+        for (entry = hash_table[index]; entry; entry = entry->next) {
+                if (!strcmp(entry->name, name)) {
+                        entry->hits++;
+                        return entry->path;
+                }
+        }
+
+        path = path_search(name);
+        if (path == NULL)
+                return NULL;
+        entry = malloc(sizeof(struct HashEntry));
+        entry->name = strdup(name);
+        entry->path = path;
+        entry->hits = 1;
+        entry->next = hash_table[index];
+        hash_table[index] = entry;
+        return path;
+}
+
+// hash: list the table
+// hash -r: clear it
+// hash name...: look the names up now, without using them
+void hash_builtin(struct Command *command) {
+        if (command->args[1] == NULL) {
+                hash_check_path();
+                fprintf(stdout, "hits\tcommand\n");
+                for (int i = 0; i < HASH_BUCKETS; i++) {
+                        for (struct HashEntry *entry = hash_table[i]; entry; entry = entry->next)
+                                fprintf(stdout, "%4d\t%s\n", entry->hits, entry->path);
+                }
+                return;
+        }
+        if (!strcmp(command->args[1], "-r")) {
+                hash_clear();
+                return;
+        }
+        for (int i = 1; command->args[i]; i++) {
+                struct HashEntry *entry;
+                const char *path;
+
+                if (strchr(command->args[i], '/'))
+                        continue;
+                hash_check_path();
+                hash_forget(command->args[i]);
+                path = resolve_command(command->args[i]);
+                if (path == NULL) {
+                        fprintf(stderr, "hash: %s: not found\n", command->args[i]);
+                        continue;
+                }
+                // seeding is not a use
+                entry = hash_table[hash_index(command->args[i])];
+                for (; entry; entry = entry->next) {
+                        if (entry->path == path)
+                                entry->hits = 0;
+                }
+        }
+}
+
+extern char **environ;
+
+// Build with -DSSHELL_FORK_LAUNCH to make fork the default, and set
+// SSHELL_LAUNCH=fork, SSHELL_LAUNCH=spawn or SSHELL_LAUNCH=zygote to pick
+// one at runtime.
+#ifdef SSHELL_FORK_LAUNCH
+#define LAUNCH_DEFAULT LAUNCH_FORK
+#else
+#define LAUNCH_DEFAULT LAUNCH_SPAWN
+#endif
+static enum LaunchMode launch_mode = LAUNCH_DEFAULT;
+
+// Called before the shell has grown, so that the zygote is small
+void launch_init(void) {
+        char *mode = getenv("SSHELL_LAUNCH");
+
+        if (mode == NULL)
+                return;
+        if (!strcmp(mode, "fork"))
+                launch_mode = LAUNCH_FORK;
+        else if (!strcmp(mode, "spawn"))
+                launch_mode = LAUNCH_SPAWN;
+        else if (!strcmp(mode, "zygote") && zygote_start())
+                launch_mode = LAUNCH_ZYGOTE;
+}
+
+void plan_dup(struct Launch *plan, int fd, int target) {
+        plan->actions[plan->nactions].kind = FD_DUP;
+        plan->actions[plan->nactions].fd = fd;
+        plan->actions[plan->nactions].target = target;
+        plan->nactions++;
+}
+
+void plan_close(struct Launch *plan, int fd) {
+        plan->actions[plan->nactions].kind = FD_CLOSE;
+        plan->actions[plan->nactions].fd = fd;
+        plan->nactions++;
+}
+
+// The resources "limit" sets
+static const struct LimitName limit_names[] = {
+        { "mem", RLIMIT_AS, LIMIT_BYTES },
+        { "cpu", RLIMIT_CPU, LIMIT_SECONDS },
+        { "nofile", RLIMIT_NOFILE, LIMIT_COUNT },
+        { "nproc", RLIMIT_NPROC, LIMIT_COUNT },
+        { "fsize", RLIMIT_FSIZE, LIMIT_BYTES },
+        { "stack", RLIMIT_STACK, LIMIT_BYTES },
+        { "core", RLIMIT_CORE, LIMIT_BYTES },
+};
+
+#define LIMIT_NAMES (int)(sizeof(limit_names) / sizeof(limit_names[0]))
+
+// Read a CPU list, e.g. 0-3,6. Returns false if it is not one.
+bool parse_cpus(const char *text, cpu_set_t *cpus) {
+        CPU_ZERO(cpus);
+        while (1) {
+                char *end;
+                long first, last;
+
+                if (*text < '0' || *text > '9')
+                        return false;
+                first = last = strtol(text, &end, 10);
+                if (*end == '-') {
+                        text = end + 1;
+                        if (*text < '0' || *text > '9')
+                                return false;
+                        last = strtol(text, &end, 10);
+                }
+                if (last < first || last >= CPU_SETSIZE)
+                        return false;
+                for (long cpu = first; cpu <= last; cpu++)
+                        CPU_SET(cpu, cpus);
+                if (*end == '\0')
+                        return true;
+                if (*end != ',')
+                        return false;
+                text = end + 1;
+        }
+}
+
+// Read a time: a number of seconds, or of minutes or hours with an m or
+// h after it. Returns -1 if it is not one.
+long long parse_seconds(const char *text) {
+        char *end;
+        long long seconds;
+
+        errno = 0;
+        seconds = strtoll(text, &end, 10);
+        if (end == text || seconds < 0 || errno)
+                return -1;
+        if (*end == 's') {
+                end++;
+        } else if (*end == 'm' && seconds <= LLONG_MAX / 60) {
+                seconds *= 60;
+                end++;
+        } else if (*end == 'h' && seconds <= LLONG_MAX / 3600) {
+                seconds *= 3600;
+                end++;
+        }
+        return *end == '\0' ? seconds : -1;
+}
+
+// Read one NAME=VALUE of "limit" into limits: a limit_names resource, a
+// number of bytes, seconds or a count, or unlimited; nice=N, added to
+// the niceness; io=CLASS[:LEVEL], the I/O class idle, be or rt and its
+// level from 0 to 7. Returns false if it is not one.
+bool parse_limit(const char *arg, struct Limits *limits) {
+        const char *value = strchr(arg, '=') + 1;
+        size_t len = value - 1 - arg;
+        char *end;
+
+        if (len == 4 && !strncmp(arg, "nice", 4)) {
+                long n = strtol(value, &end, 10);
+
+                if (end == value || *end != '\0' || n < -40 || n > 40)
+                        return false;
+                limits->niced = true;
+                limits->nice = n;
+                return true;
+        }
+        if (len == 2 && !strncmp(arg, "io", 2)) {
+                int class, level = 4;
+
+                if (!strcmp(value, "idle")) {
+                        class = IOPRIO_CLASS_IDLE;
+                        level = 0;
+                } else if (!strncmp(value, "be", 2) || !strncmp(value, "rt", 2)) {
+                        class = value[0] == 'b' ? IOPRIO_CLASS_BE : IOPRIO_CLASS_RT;
+                        if (value[2] == ':' && value[3] >= '0' && value[3] <= '7' && value[4] == '\0')
+                                level = value[3] - '0';
+                        else if (value[2] != '\0')
+                                return false;
+                } else {
+                        return false;
+                }
+                limits->ioprio = class << IOPRIO_CLASS_SHIFT | level;
+                return true;
+        }
+        for (int i = 0; i < LIMIT_NAMES; i++) {
+                long long n;
+
+                if (strlen(limit_names[i].name) != len || strncmp(arg, limit_names[i].name, len))
+                        continue;
+                if (!strcmp(value, "unlimited")) {
+                        limits->rlimits[i] = RLIM_INFINITY;
+                } else {
+                        if (limit_names[i].unit == LIMIT_BYTES)
+                                n = parse_bytes(value);
+                        else if (limit_names[i].unit == LIMIT_SECONDS)
+                                n = parse_seconds(value);
+                        else if ((n = strtoll(value, &end, 10)) < 0 || end == value || *end != '\0')
+                                n = -1;
+                        if (n == -1)
+                                return false;
+                        limits->rlimits[i] = n;
+                }
+                limits->rlimits_set |= 1u << i;
+                return true;
+        }
+        return false;
+}
+
+// Take the "limit" and "pin" prefixes off a command, into its limits:
+// "limit NAME=VALUE... command" and "pin CPUS command", in any order.
+// Returns false, once reported, if one is wrong.
+bool limit_prefixes(struct Arena *arena, struct Command *command) {
+        command->limits = NULL;
+        while (command->cmd && (!strcmp(command->cmd, "limit") || !strcmp(command->cmd, "pin"))) {
+                int used = 1;
+
+                if (command->limits == NULL) {
+                        command->limits = arena_alloc(arena, sizeof(struct Limits));
+                        memset(command->limits, 0, sizeof(struct Limits));
+                }
+                if (!strcmp(command->cmd, "pin")) {
+                        if (command->argc < 2 || !parse_cpus(command->args[1], &command->limits->cpus)) {
+                                fprintf(stderr, "Error: invalid CPU list\n");
+                                return false;
+                        }
+                        command->limits->pinned = true;
+                        used = 2;
+                } else {
+                        while (command->args[used] && strchr(command->args[used], '=')) {
+                                if (!parse_limit(command->args[used], command->limits)) {
+                                        fprintf(stderr, "Error: invalid limit\n");
+                                        return false;
+                                }
+                                used++;
+                        }
+                }
+                if (command->argc <= used) {
+                        fprintf(stderr, "Error: missing command\n");
+                        return false;
+                }
+                command->args += used;
+                command->argc -= used;
+                command->cmd = command->args[0];
+        }
+        return true;
+}
+
+bool limits_any(const struct Limits *limits) {
+        return limits->rlimits_set || limits->pinned || limits->niced || limits->ioprio;
+}
+
+// Apply the limits to the child about to exec the command. A limit
+// below the hard one lowers both, so that the command cannot raise it
+// back. Returns false, once reported, if one cannot be applied.
+bool limits_apply(const struct Limits *limits) {
+        for (int i = 0; i < LIMIT_NAMES; i++) {
+                struct rlimit rl;
+
+                if (!(limits->rlimits_set & 1u << i))
+                        continue;
+                getrlimit(limit_names[i].resource, &rl);
+                rl.rlim_cur = limits->rlimits[i];
+                if (rl.rlim_cur < rl.rlim_max)
+                        rl.rlim_max = rl.rlim_cur;
+                if (setrlimit(limit_names[i].resource, &rl) == -1) {
+                        fprintf(stderr, "limit: %s: %s\n", limit_names[i].name, strerror(errno));
+                        return false;
+                }
+        }
+        errno = 0;
+        if (limits->niced && nice(limits->nice) == -1 && errno) {
+                fprintf(stderr, "limit: nice: %s\n", strerror(errno));
+                return false;
+        }
+        if (limits->ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, limits->ioprio) == -1) {
+                fprintf(stderr, "limit: io: %s\n", strerror(errno));
+                return false;
+        }
+        if (limits->pinned && sched_setaffinity(0, sizeof(cpu_set_t), &limits->cpus) == -1) {
+                fprintf(stderr, "pin: %s\n", strerror(errno));
+                return false;
+        }
+        return true;
+}
+
+// Move a descriptor of the shell above the ones a redirection can name,
+// so that applying a plan never replaces it before it is used
+int fd_above(int fd) {
+        int moved;
+
+        if (fd == -1 || fd >= MAX_REDIRECT_FD)
+                return fd;
+        moved = fcntl(fd, F_DUPFD_CLOEXEC, MAX_REDIRECT_FD);
+        close(fd);
+        return moved;
+}
+
+// Times of the shell's own work, for "stats", and where the trace goes,
+// -1 without one
+static struct Stat stats[STAT_KINDS];
+static int trace_fd = -1;
+
+static const char *const stat_names[STAT_KINDS] = {
+        "parse", "expand", "lookup", "launch", "exit", "builtin",
+};
+
+uint64_t timespec_ns(const struct timespec *ts) {
+        return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+uint64_t clock_ns(void) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return timespec_ns(&now);
+}
+
+// The bucket of a time: below 4ns its own, then four per power of two
+int stat_bucket(uint64_t ns) {
+        int bits;
+
+        if (ns < 4)
+                return ns;
+        bits = 63 - __builtin_clzll(ns);
+        return (bits - 1) * 4 + (ns >> (bits - 2) & 3);
+}
+
+// The shortest time in a bucket
+uint64_t stat_bucket_ns(int bucket) {
+        if (bucket < 4)
+                return bucket;
+        return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+void stat_add(enum StatKind kind, uint64_t ns) {
+        struct Stat *stat = &stats[kind];
+
+        if (stat->count == 0 || ns < stat->min)
+                stat->min = ns;
+        if (ns > stat->max)
+                stat->max = ns;
+        stat->count++;
+        stat->total += ns;
+        stat->buckets[stat_bucket(ns)]++;
+}
+
+// The time a fraction of the times are below: the end of the bucket it
+// falls in, so within a quarter of a power of two
+uint64_t stat_percentile(const struct Stat *stat, double fraction) {
+        uint64_t rank = fraction * stat->count;
+        uint64_t seen = 0;
+
+        for (int i = 0; i < STAT_BUCKETS - 1; i++) {
+                seen += stat->buckets[i];
+                if (seen > rank)
+                        return stat_bucket_ns(i + 1) < stat->max ? stat_bucket_ns(i + 1) : stat->max;
+        }
+        return stat->max;
+}
+
+// Open the file $SSHELL_TRACE names, to stream the trace to
+void trace_open(void) {
+        const char *path = getenv("SSHELL_TRACE");
+
+        if (path == NULL || *path == '\0')
+                return;
+        trace_fd = fd_above(open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644));
+        if (trace_fd == -1)
+                fprintf(stderr, "sshell: %s: %s\n", path, strerror(errno));
+}
+
+// Quote a string for JSON into out, which has size bytes. The end is
+// cut if it does not fit.
+void json_string(char *out, size_t size, const char *text) {
+        size_t len = 0;
+
+        out[len++] = '"';
+        for (; *text && len + 8 < size; text++) {
+                unsigned char c = *text;
+
+                if (c == '"' || c == '\\') {
+                        out[len++] = '\\';
+                        out[len++] = c;
+                } else if (c < 0x20) {
+                        len += snprintf(out + len, size - len, "\\u%04x", c);
+                } else {
+                        out[len++] = c;
+                }
+        }
+        out[len++] = '"';
+        out[len] = '\0';
+}
+
+// Write one trace event: a JSON object on its own line with the time,
+// the shell's pid, the event and the fields given. The line is written
+// at once, so that shells tracing to the same file do not mix their
+// lines.
+void trace(const char *event, const char *format, ...) {
+        char line[2 * CMDLINE_MAX];
+        va_list args;
+        int len;
+
+        len = snprintf(line, sizeof(line), "{\"ts_ns\":%llu,\"shell\":%d,\"event\":\"%s\",",
+                       (unsigned long long)clock_ns(), getpid(), event);
+        va_start(args, format);
+        len += vsnprintf(line + len, sizeof(line) - len - 2, format, args);
+        va_end(args);
+        if (len > (int)sizeof(line) - 3)
+                return;
+        line[len++] = '}';
+        line[len++] = '\n';
+        if (write(trace_fd, line, len) == -1) {
+                close(trace_fd);
+                trace_fd = -1;
+        }
+}
+
+// Count a child started since start, with lookup ns to find the command,
+// and trace it
+void stat_launch(struct Command *command, const char *mode, pid_t pid, uint64_t start,
+                 uint64_t lookup) {
+        uint64_t ns = clock_ns() - start;
+        char cmd[CMDLINE_MAX];
+
+        if (pid > 0)
+                stat_add(STAT_LAUNCH, ns);
+        if (trace_fd == -1)
+                return;
+        json_string(cmd, sizeof(cmd), command->cmd);
+        trace("launch", "\"cmd\":%s,\"mode\":\"%s\",\"pid\":%d,\"lookup_ns\":%llu,\"ns\":%llu",
+              cmd, mode, pid, (unsigned long long)lookup, (unsigned long long)ns);
+}
+
+// Count a builtin the shell ran itself since start, and trace it
+void stat_builtin(struct Command *command, int status, uint64_t start) {
+        uint64_t ns = clock_ns() - start;
+        char cmd[CMDLINE_MAX];
+
+        stat_add(STAT_BUILTIN, ns);
+        if (trace_fd == -1)
+                return;
+        json_string(cmd, sizeof(cmd), command->cmd);
+        trace("builtin", "\"cmd\":%s,\"status\":%d,\"ns\":%llu", cmd, status, (unsigned long long)ns);
+}
+
+// Count the work on a line or a pipeline, parse or expand, since start
+void stat_text(enum StatKind kind, const char *text, uint64_t start) {
+        uint64_t ns = clock_ns() - start;
+        char quoted[CMDLINE_MAX];
+
+        stat_add(kind, ns);
+        if (trace_fd == -1)
+                return;
+        json_string(quoted, sizeof(quoted), text);
+        trace(stat_names[kind], "\"text\":%s,\"ns\":%llu", quoted, (unsigned long long)ns);
+}
+
+// Tell why a command could not be started: it was not found, or the
+// kernel refused to run the file it names
+void exec_error(int fd, const char *cmd, int err) {
+        if (err == ENOENT)
+                dprintf(fd, "Error: command not found\n");
+        else
+                dprintf(fd, "Error: %s: %s\n", cmd, strerror(err));
+}
+
+// The arguments that run a file without a #! line as a script of
+// /bin/sh, as execvp does: argv needs room for argc + 2 entries
+void shell_args(char **argv, const char *path, struct Command *command) {
+        argv[0] = "/bin/sh";
+        argv[1] = (char *)path;
+        for (int i = 1; i <= command->argc; i++)
+                argv[i + 1] = command->args[i];
+}
+
+pid_t launch_fork(const char *path, struct Command *command, struct Launch *plan) {
+        pid_t pid = fork();
+
+        if (pid == 0) {
+                // child
+                sigset_t none;
+
+                setpgid(0, plan->pgid);
+                signal(SIGTTOU, SIG_DFL);
+                sigemptyset(&none);
+                sigprocmask(SIG_SETMASK, &none, NULL);
+                for (int i = 0; i < plan->nactions; i++) {
+                        if (plan->actions[i].kind == FD_DUP)
+                                dup2(plan->actions[i].fd, plan->actions[i].target);
+                        else
+                                close(plan->actions[i].fd);
+                }
+                if (!limits_apply(&plan->limits))
+                        exit(1);
+                execv(path, command->args);
+                if (errno == ENOEXEC) {
+                        char *argv[command->argc + 2];
+
+                        shell_args(argv, path, command);
+                        execv(argv[0], argv);
+                        errno = ENOEXEC;
+                }
+                exec_error(STDERR_FILENO, command->cmd, errno);
+                exit(1);
+        }
+        return pid;
+}
+
+pid_t launch_spawn(const char *path, struct Command *command, struct Launch *plan) {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t sigdefault;
+        sigset_t sigmask;
+        pid_t pid;
+        int ret;
+
+        posix_spawn_file_actions_init(&actions);
+        for (int i = 0; i < plan->nactions; i++) {
+                if (plan->actions[i].kind == FD_DUP)
+                        posix_spawn_file_actions_adddup2(&actions,
+                                plan->actions[i].fd, plan->actions[i].target);
+                else
+                        posix_spawn_file_actions_addclose(&actions,
+                                plan->actions[i].fd);
+        }
+
+        sigemptyset(&sigdefault);
+        sigaddset(&sigdefault, SIGTTOU);
+        // the shell blocks SIGCHLD while it starts a job
+        sigemptyset(&sigmask);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF |
+                POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&attr, plan->pgid);
+        posix_spawnattr_setsigdefault(&attr, &sigdefault);
+        posix_spawnattr_setsigmask(&attr, &sigmask);
+
+        ret = posix_spawn(&pid, path, &actions, &attr, command->args, environ);
+        if (ret == ENOEXEC) {
+                char *argv[command->argc + 2];
+
+                shell_args(argv, path, command);
+                ret = posix_spawn(&pid, argv[0], &actions, &attr, argv, environ);
+        }
+
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        if (ret != 0) {
+                errno = ret;
+                return -1;
+        }
+        return pid;
+}
+
+// The zygote: requests and replies go through one socket, and the
+// children's state changes through another, read by the SIGCHLD handler.
+// zygote_env and zygote_cwd are the environment and the directory as
+// the zygote last saw them.
+static int zygote_requests = -1;
+static int zygote_events = -1;
+static pid_t zygote_shell;
+static char **zygote_env;
+static int zygote_nenv;
+static const char *zygote_cwd;
+
+// Take a copy of the environment's entries. setenv replaces only the
+// entries it changes, so comparing the pointers finds the changes.
+void zygote_env_save(void) {
+        int count = 0;
+
+        while (environ[count])
+                count++;
+        free(zygote_env);
+        zygote_env = malloc((count + 1) * sizeof(char *));
+        memcpy(zygote_env, environ, (count + 1) * sizeof(char *));
+        zygote_nenv = count;
+}
+
+bool env_has(char **env, int count, const char *entry) {
+        for (int i = 0; i < count; i++) {
+                if (env[i] == entry)
+                        return true;
+        }
+        return false;
+}
+
+// Whether environ has a variable named like entry
+bool env_has_name(const char *entry) {
+        size_t len = strcspn(entry, "=");
+
+        for (char **e = environ; *e; e++) {
+                if (!strncmp(*e, entry, len) && (*e)[len] == '=')
+                        return true;
+        }
+        return false;
+}
+
+// Add a string to a request. Returns false if it does not fit.
+bool zygote_add(char *buf, size_t *len, const char *string, size_t size) {
+        if (*len + size + 1 > ZYGOTE_MSG_MAX)
+                return false;
+        memcpy(buf + *len, string, size);
+        buf[*len + size] = '\0';
+        *len += size + 1;
+        return true;
+}
+
+// Receive a message and the descriptors passed with it, close-on-exec
+ssize_t zygote_recv(int sock, char *buf, size_t size, int *fds, int *nfds) {
+        char control[CMSG_SPACE(sizeof(int) * MAX_FD_ACTIONS)];
+        struct iovec iov = { .iov_base = buf, .iov_len = size };
+        struct msghdr msg = {
+                .msg_iov = &iov, .msg_iovlen = 1,
+                .msg_control = control, .msg_controllen = sizeof(control),
+        };
+        ssize_t len;
+
+        while ((len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+                ;
+        *nfds = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); len > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                        *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                        memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+                }
+        }
+        return len;
+}
+
+// Start one child for the shell: apply the environment changes to the
+// zygote's own environment, then fork and exec as launch_fork does
+void zygote_launch(int sock, char *buf, ssize_t len, int *fds, int nfds) {
+        struct ZygoteRequest *req = (struct ZygoteRequest *)buf;
+        struct ZygoteReply reply = { -1, EINVAL };
+        struct Command command = {0};
+        char *p = buf + sizeof(struct ZygoteRequest);
+        char *path = p;
+
+        buf[len - 1] = '\0';
+        command.args = malloc((req->argc + 1) * sizeof(char *));
+        p += strlen(p) + 1;
+        for (int i = 0; i < req->argc; i++) {
+                command.args[i] = p;
+                p += strlen(p) + 1;
+        }
+        command.args[req->argc] = NULL;
+        command.argc = req->argc;
+        command.cmd = command.args[0];
+        for (int i = 0; i < req->nenv; i++) {
+                char *eq = strchr(p, '=');
+                if (eq) {
+                        *eq = '\0';
+                        setenv(p, eq + 1, 1);
+                        *eq = '=';
+                } else {
+                        unsetenv(p);
+                }
+                p += strlen(p) + 1;
+        }
+        if (req->cwd && chdir(p) == -1) {
+                reply.error = errno;
+                send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+                free(command.args);
+                for (int i = 0; i < nfds; i++)
+                        close(fds[i]);
+                return;
+        }
+        // the passed descriptors must not be replaced by the plan before
+        // they are copied
+        for (int i = 0; i < nfds; i++)
+                fds[i] = fd_above(fds[i]);
+        for (int i = 0; i < req->plan.nactions; i++) {
+                struct FdAction *action = &req->plan.actions[i];
+                if (action->kind == FD_DUP)
+                        action->fd = action->fd < nfds ? fds[action->fd] : -1;
+        }
+
+        reply.pid = launch_fork(path, &command, &req->plan);
+        reply.error = errno;
+        if (reply.pid > 0)
+                setpgid(reply.pid, req->plan.pgid ? req->plan.pgid : reply.pid);
+        for (int i = 0; i < nfds; i++)
+                close(fds[i]);
+        free(command.args);
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+// The zygote's loop: start children as the shell asks, and tell it when
+// one of them is reaped or stopped. It leaves when the shell does.
+void zygote_main(int requests, int events) {
+        static char buf[ZYGOTE_MSG_MAX];
+        struct pollfd pfds[2];
+        sigset_t chld;
+
+        // in its own process group, out of reach of the terminal's signals
+        setpgid(0, 0);
+        signal(SIGCHLD, SIG_DFL);
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &chld, NULL);
+        pfds[0].fd = requests;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+        pfds[1].events = POLLIN;
+
+        while (1) {
+                if (poll(pfds, 2, -1) == -1)
+                        continue;
+                if (pfds[1].revents & POLLIN) {
+                        struct signalfd_siginfo info;
+                        struct ZygoteEvent event;
+                        bool any = false;
+
+                        while (read(pfds[1].fd, &info, sizeof(info)) > 0)
+                                ;
+                        while ((event.pid = wait4(-1, &event.status, WNOHANG | WUNTRACED,
+                                                  &event.usage)) > 0) {
+                                send(events, &event, sizeof(event), MSG_NOSIGNAL);
+                                any = true;
+                        }
+                        if (any)
+                                kill(zygote_shell, SIGCHLD);
+                }
+                if (pfds[0].revents & (POLLIN | POLLHUP)) {
+                        int fds[MAX_FD_ACTIONS];
+                        int nfds;
+                        ssize_t len = zygote_recv(requests, buf, sizeof(buf), fds, &nfds);
+
+                        if (len <= 0)
+                                _exit(0);
+                        if ((size_t)len > sizeof(struct ZygoteRequest))
+                                zygote_launch(requests, buf, len, fds, nfds);
+                }
+        }
+}
+
+// Fork the zygote. Returns false if it could not be started.
+bool zygote_start(void) {
+        int requests[2], events[2];
+        pid_t pid;
+
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, requests) == -1)
+                return false;
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, events) == -1) {
+                close(requests[0]);
+                close(requests[1]);
+                return false;
+        }
+        zygote_shell = getpid();
+        pid = fork();
+        if (pid == 0) {
+                close(requests[0]);
+                close(events[0]);
+                zygote_main(requests[1], events[1]);
+        }
+        close(requests[1]);
+        close(events[1]);
+        if (pid == -1) {
+                close(requests[0]);
+                close(events[0]);
+                return false;
+        }
+        zygote_requests = requests[0];
+        zygote_events = events[0];
+        fcntl(zygote_events, F_SETFL, O_NONBLOCK);
+        zygote_env_save();
+        return true;
+}
+
+// Stop using the zygote, in a copy of the shell or once it is gone
+void zygote_stop(void) {
+        if (zygote_requests != -1) {
+                close(zygote_requests);
+                close(zygote_events);
+        }
+        zygote_requests = -1;
+        zygote_events = -1;
+        if (launch_mode == LAUNCH_ZYGOTE)
+                launch_mode = LAUNCH_DEFAULT;
+}
+
+// Hand the state changes the zygote reported to the job table. Called
+// by the SIGCHLD handler. Returns true once the zygote is gone, after
+// which commands are started directly.
+bool zygote_reap(void) {
+        static const char gone[] = "sshell: the launcher is gone, starting commands directly\n";
+        struct ZygoteEvent event;
+        ssize_t len;
+
+        if (zygote_events == -1)
+                return false;
+        while ((len = recv(zygote_events, &event, sizeof(event), MSG_DONTWAIT)) == sizeof(event))
+                job_update(event.pid, event.status, &event.usage);
+        if (len != 0)
+                return false;
+        write(STDERR_FILENO, gone, sizeof(gone) - 1);
+        zygote_stop();
+        return true;
+}
+
+// Ask the zygote to start a child. The request carries the environment
+// changes since the last one. Returns -1 with errno E2BIG if it is too
+// large, and the shell starts the child itself.
+pid_t launch_zygote(const char *path, struct Command *command, struct Launch *plan) {
+        static char buf[ZYGOTE_MSG_MAX];
+        struct ZygoteRequest *req = (struct ZygoteRequest *)buf;
+        char control[CMSG_SPACE(sizeof(int) * MAX_FD_ACTIONS)] = {0};
+        size_t len = sizeof(struct ZygoteRequest);
+        int fds[MAX_FD_ACTIONS];
+        int nfds = 0;
+        struct ZygoteReply reply;
+        struct iovec iov;
+        struct msghdr msg = {0};
+        bool fits;
+
+        req->plan = *plan;
+        for (int i = 0; i < plan->nactions; i++) {
+                struct FdAction *action = &req->plan.actions[i];
+                int fd = action->fd;
+                int index = 0;
+                bool local = false;
+
+                if (action->kind != FD_DUP)
+                        continue;
+                // a source an earlier action set is the child's: it
+                // holds what that action copied, or nothing once closed
+                for (int j = i - 1; j >= 0; j--) {
+                        if (plan->actions[j].kind == FD_DUP && plan->actions[j].target == fd) {
+                                action->fd = req->plan.actions[j].fd;
+                                local = true;
+                                break;
+                        }
+                        if (plan->actions[j].kind == FD_CLOSE && plan->actions[j].fd == fd) {
+                                action->fd = MAX_FD_ACTIONS;
+                                local = true;
+                                break;
+                        }
+                }
+                if (local)
+                        continue;
+                while (index < nfds && fds[index] != fd)
+                        index++;
+                if (index == nfds)
+                        fds[nfds++] = fd;
+                action->fd = index;
+        }
+        req->argc = command->argc;
+        req->nenv = 0;
+        fits = zygote_add(buf, &len, path, strlen(path));
+        for (int i = 0; fits && i < command->argc; i++)
+                fits = zygote_add(buf, &len, command->args[i], strlen(command->args[i]));
+        for (char **e = environ; fits && *e; e++) {
+                if (env_has(zygote_env, zygote_nenv, *e))
+                        continue;
+                fits = zygote_add(buf, &len, *e, strlen(*e));
+                req->nenv++;
+        }
+        for (int i = 0; fits && i < zygote_nenv; i++) {
+                char **e = environ;
+                while (*e && *e != zygote_env[i])
+                        e++;
+                if (*e || env_has_name(zygote_env[i]))
+                        continue;
+                fits = zygote_add(buf, &len, zygote_env[i], strcspn(zygote_env[i], "="));
+                req->nenv++;
+        }
+        // the directory stack interns its paths, so a new directory is
+        // a new pointer
+        req->cwd = dir_top() != zygote_cwd;
+        if (fits && req->cwd)
+                fits = zygote_add(buf, &len, dir_top(), strlen(dir_top()));
+        if (!fits) {
+                errno = E2BIG;
+                return -1;
+        }
+
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (nfds > 0) {
+                struct cmsghdr *cmsg;
+
+                msg.msg_control = control;
+                msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+                cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+                memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+        }
+        if (sendmsg(zygote_requests, &msg, MSG_NOSIGNAL) == -1 ||
+            recv(zygote_requests, &reply, sizeof(reply), 0) != sizeof(reply)) {
+                fprintf(stderr, "sshell: the launcher is gone, starting commands directly\n");
+                zygote_stop();
+                errno = E2BIG;
+                return -1;
+        }
+        zygote_env_save();
+        zygote_cwd = dir_top();
+        errno = reply.error;
+        return reply.pid;
+}
+
+// Start a child running the command with the given launch plan.
+// Returns the child's pid, or -1 if the command could not be started.
+// The command is resolved through the hash table first, so a command
+// that is not found is caught before any child is created. With fork,
+// a command that still fails to exec is reported by the child, which
+// exits with status 1.
+pid_t launch(struct Command *command, struct Launch *plan) {
+        // posix_spawn cannot apply the limits
+        bool fork_only = launch_mode == LAUNCH_FORK || limits_any(&plan->limits);
+        uint64_t start = clock_ns();
+        uint64_t lookup;
+        const char *mode;
+        const char *path;
+        pid_t pid;
+        int saved_errno;
+
+        path = resolve_command(command->cmd);
+        lookup = clock_ns() - start;
+        stat_add(STAT_LOOKUP, lookup);
+        if (path == NULL) {
+                errno = ENOENT;
+                return -1;
+        }
+        if (launch_mode == LAUNCH_ZYGOTE) {
+                mode = "zygote";
+                pid = launch_zygote(path, command, plan);
+                if (pid == -1 && errno == E2BIG) {
+                        mode = fork_only ? "fork" : "spawn";
+                        pid = fork_only ? launch_fork(path, command, plan) :
+                                launch_spawn(path, command, plan);
+                }
+        } else if (fork_only) {
+                mode = "fork";
+                pid = launch_fork(path, command, plan);
+        } else {
+                mode = "spawn";
+                pid = launch_spawn(path, command, plan);
+                if (pid == -1 && errno == ENOENT && path != command->cmd) {
+                        // the cached file went away, look it up again
+                        hash_forget(command->cmd);
+                        path = resolve_command(command->cmd);
+                        if (path)
+                                pid = launch_spawn(path, command, plan);
+                }
+        }
+        if (pid > 0)
+                setpgid(pid, plan->pgid ? plan->pgid : pid);
+        saved_errno = errno;
+        stat_launch(command, mode, pid, start, lookup);
+        errno = saved_errno;
+        return pid;
+}
+
+// Start a child running a builtin, for a pipeline stage or a background
+// job. The child is a copy of the shell, so it applies the launch plan
+// itself and closes every other descriptor it got from the shell.
+pid_t launch_builtin(const struct Builtin *builtin, struct Command *command, struct Launch *plan) {
+        uint64_t start = clock_ns();
+        pid_t pid;
+        int status;
+        int saved_errno;
+
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+                sigset_t none;
+
+                setpgid(0, plan->pgid);
+                signal(SIGTTOU, SIG_DFL);
+                signal(SIGCHLD, SIG_DFL);
+                sigemptyset(&none);
+                sigprocmask(SIG_SETMASK, &none, NULL);
+                for (int i = 0; i < plan->nactions; i++) {
+                        if (plan->actions[i].kind == FD_DUP)
+                                dup2(plan->actions[i].fd, plan->actions[i].target);
+                        else
+                                close(plan->actions[i].fd);
+                }
+                // all the shell's descriptors but the history, which
+                // "history" reads
+                if (history.fd == -1) {
+                        close_range(STDERR_FILENO + 1, ~0U, 0);
+                } else {
+                        close_range(STDERR_FILENO + 1, history.fd - 1, 0);
+                        close_range(history.fd + 1, ~0U, 0);
+                }
+                if (!limits_apply(&plan->limits))
+                        _exit(1);
+                status = builtin->fn(command);
+                // _exit, so that the shell's exit handlers and stdio
+                // buffers are left to the shell
+                fflush(stdout);
+                _exit(status);
+        }
+        if (pid > 0)
+                setpgid(pid, plan->pgid ? plan->pgid : pid);
+        saved_errno = errno;
+        stat_launch(command, "builtin", pid, start, 0);
+        errno = saved_errno;
+        return pid;
+}
+
+// Give the terminal to a process group, or back to the shell
+void set_foreground(pid_t pgid) {
+        if (isatty(STDIN_FILENO))
+                tcsetpgrp(STDIN_FILENO, pgid);
+}
+
+// The status $? gets from a wait status
+int exit_status(int status) {
+        if (WIFSIGNALED(status))
+                return 128 + WTERMSIG(status);
+        return WEXITSTATUS(status);
+}
+
+// The job table. Children are reaped by the SIGCHLD handler, which only
+// updates the table. Everything else touching it blocks SIGCHLD first.
+static struct Job *jobs;
+
+void block_sigchld(sigset_t *old) {
+        sigset_t chld;
+
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &chld, old);
+}
+
+void unblock_sigchld(sigset_t *old) {
+        sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+// Record the new status of a child in its job
+void job_update(pid_t pid, int status, struct rusage *usage) {
+        for (struct Job *job = jobs; job; job = job->next) {
+                for (int i = 0; i < job->count; i++) {
+                        if (job->pids[i] != pid)
+                                continue;
+                        if (WIFSTOPPED(status)) {
+                                job->stopped = true;
+                        } else {
+                                job->status[i] = status;
+                                job->usage[i].usage = *usage;
+                                clock_gettime(CLOCK_MONOTONIC, &job->usage[i].end);
+                                job->pids[i] = -1;
+                                job->running--;
+                        }
+                        return;
+                }
+        }
+}
+
+// The children a lost zygote started can no longer be waited for: they
+// are counted as failed.
+void job_orphaned(void) {
+        struct rusage none = {0};
+
+        for (struct Job *job = jobs; job; job = job->next) {
+                for (int i = 0; i < job->count; i++) {
+                        pid_t pid = job->pids[i];
+
+                        if (pid > 0 && waitpid(pid, NULL, WNOHANG) == -1 && errno == ECHILD)
+                                job_update(pid, 1 << 8, &none);
+                }
+        }
+}
+
+void sigchld_handler(int signo) {
+        int saved_errno = errno;
+        struct rusage usage;
+        pid_t pid;
+        int status;
+
+        (void)signo;
+        while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &usage)) > 0)
+                job_update(pid, status, &usage);
+        if (zygote_reap())
+                job_orphaned();
+        errno = saved_errno;
+}
+
+// Jobs are kept oldest first
+void job_add(struct Job *job) {
+        struct Job **link = &jobs;
+
+        while (*link)
+                link = &(*link)->next;
+        job->next = NULL;
+        *link = job;
+}
+
+void job_remove(struct Job *job) {
+        for (struct Job **link = &jobs; *link; link = &(*link)->next) {
+                if (*link == job) {
+                        *link = job->next;
+                        return;
+                }
+        }
+}
+
+int job_next_id(void) {
+        int id = 0;
+
+        for (struct Job *job = jobs; job; job = job->next) {
+                if (job->id > id)
+                        id = job->id;
+        }
+        return id + 1;
+}
+
+// Copy a job into its own memory, so that it outlives the line it was
+// started from. The copy takes the place of the job in the table.
+struct Job *job_detach(struct Job *job) {
+        struct Job *copy = malloc(sizeof(struct Job));
+
+        *copy = *job;
+        copy->cmdline = strdup(job->cmdline);
+        copy->pids = malloc(job->count * sizeof(pid_t));
+        copy->status = malloc(job->count * sizeof(int));
+        copy->usage = malloc(job->count * sizeof(struct StageUsage));
+        memcpy(copy->pids, job->pids, job->count * sizeof(pid_t));
+        memcpy(copy->status, job->status, job->count * sizeof(int));
+        memcpy(copy->usage, job->usage, job->count * sizeof(struct StageUsage));
+        copy->id = job_next_id();
+        job_remove(job);
+        job_add(copy);
+        return copy;
+}
+
+void job_free(struct Job *job) {
+        free(job->cmdline);
+        free(job->pids);
+        free(job->status);
+        free(job->usage);
+        free(job);
+}
+
+struct Job *job_find(int id) {
+        for (struct Job *job = jobs; job; job = job->next) {
+                if (job->id == id)
+                        return job;
+        }
+        return NULL;
+}
+
+double timespec_seconds(const struct timespec *ts) {
+        return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+double timeval_seconds(const struct timeval *tv) {
+        return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Print one line of resource usage, for the pipeline or for one stage.
+// real is the wall time in seconds.
+void print_usage(const char *label, double real, const struct rusage *usage) {
+        fprintf(stderr, "+ time %s real %.6fs user %.6fs sys %.6fs maxrss %ldkB csw %ld+%ld\n",
+                label, real,
+                timeval_seconds(&usage->ru_utime), timeval_seconds(&usage->ru_stime),
+                usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+// Report the resources a job used: the whole pipeline first, then each
+// stage when there are several. Times add up, max RSS is the largest.
+void print_job_usage(struct Job *job) {
+        struct rusage total = {0};
+        double start = timespec_seconds(&job->start);
+        double end = start;
+
+        for (int i = 0; i < job->count; i++) {
+                struct rusage *usage = &job->usage[i].usage;
+                double stage_end = timespec_seconds(&job->usage[i].end);
+
+                timeradd(&total.ru_utime, &usage->ru_utime, &total.ru_utime);
+                timeradd(&total.ru_stime, &usage->ru_stime, &total.ru_stime);
+                if (usage->ru_maxrss > total.ru_maxrss)
+                        total.ru_maxrss = usage->ru_maxrss;
+                total.ru_nvcsw += usage->ru_nvcsw;
+                total.ru_nivcsw += usage->ru_nivcsw;
+                if (stage_end > end)
+                        end = stage_end;
+        }
+        fprintf(stderr, "+ time \'%s\'\n", job->cmdline);
+        print_usage("total", end - start, &total);
+        if (job->count == 1)
+                return;
+        fprintf(stderr, "+ time pipes %d x %dkB\n", job->count - 1, job->pipesize / 1024);
+        for (int i = 0; i < job->count; i++) {
+                char label[16];
+                double stage_end = timespec_seconds(&job->usage[i].end);
+
+                // a stage that never started has no end
+                if (stage_end < start)
+                        stage_end = start;
+                snprintf(label, sizeof(label), "[%d]", i + 1);
+                print_usage(label, stage_end - start, &job->usage[i].usage);
+        }
+}
+
+// Note when a stage's child was started, for its STAT_EXIT time
+void stage_started(struct StageUsage *usage, pid_t pid) {
+        clock_gettime(CLOCK_MONOTONIC, &usage->start);
+        usage->pid = pid;
+}
+
+// Count the children of a job once it is done, and trace them
+void stat_job(struct Job *job) {
+        char cmdline[CMDLINE_MAX];
+
+        if (trace_fd != -1)
+                json_string(cmdline, sizeof(cmdline), job->cmdline);
+        for (int i = 0; i < job->count; i++) {
+                uint64_t ns;
+
+                if (job->usage[i].pid <= 0)
+                        continue;
+                ns = timespec_ns(&job->usage[i].end) - timespec_ns(&job->usage[i].start);
+                stat_add(STAT_EXIT, ns);
+                if (trace_fd != -1)
+                        trace("exit", "\"job\":%s,\"stage\":%d,\"pid\":%d,\"status\":%d,\"ns\":%llu",
+                              cmdline, i, job->usage[i].pid, exit_status(job->status[i]),
+                              (unsigned long long)ns);
+        }
+}
+
+void print_completed(struct Job *job) {
+        stat_job(job);
+        if (!quiet) {
+                fprintf(stderr, "+ completed \'%s\' ", job->cmdline);
+                for (int i = 0; i < job->count; i++)
+                        fprintf(stderr, "[%d]", exit_status(job->status[i]));
+                fprintf(stderr, "\n");
+        }
+        if (job->timed)
+                print_job_usage(job);
+}
+
+// Wait for a job in the foreground, until it is done or stopped.
+// SIGCHLD must be blocked, old is the mask to wait with.
+void job_wait(struct Job *job, sigset_t *old) {
+        set_foreground(job->pgid);
+        while (job->running > 0 && !job->stopped)
+                sigsuspend(old);
+        set_foreground(getpgrp());
+}
+
+// Report and drop every background job that is done
+void report_jobs(void) {
+        sigset_t old;
+        struct Job **link = &jobs;
+
+        block_sigchld(&old);
+        while (*link) {
+                struct Job *job = *link;
+                if (job->running == 0) {
+                        *link = job->next;
+                        print_completed(job);
+                        job_free(job);
+                } else {
+                        link = &job->next;
+                }
+        }
+        unblock_sigchld(&old);
+}
+
+bool jobs_running(void) {
+        sigset_t old;
+        bool running = false;
+
+        block_sigchld(&old);
+        for (struct Job *job = jobs; job; job = job->next) {
+                if (job->running > 0)
+                        running = true;
+        }
+        unblock_sigchld(&old);
+        return running;
+}
+
+// Get the job named by "%n" or "n", or the most recent one with no name
+struct Job *job_from_arg(char *arg) {
+        if (arg == NULL) {
+                struct Job *job = jobs;
+                while (job && job->next)
+                        job = job->next;
+                return job;
+        }
+        if (*arg == '%')
+                arg++;
+        return job_find(atoi(arg));
+}
+
+// jobs: list the background jobs
+void jobs_builtin(void) {
+        sigset_t old;
+
+        block_sigchld(&old);
+        for (struct Job *job = jobs; job; job = job->next) {
+                fprintf(stdout, "[%d] %s \'%s\'\n", job->id,
+                        job->running == 0 ? "Done" : job->stopped ? "Stopped" : "Running",
+                        job->cmdline);
+        }
+        unblock_sigchld(&old);
+}
+
+// wait: wait for every background job
+// wait %n: wait for job n
+void wait_builtin(struct Command *command) {
+        sigset_t old;
+
+        block_sigchld(&old);
+        if (command->args[1]) {
+                for (int i = 1; command->args[i]; i++) {
+                        struct Job *job = job_from_arg(command->args[i]);
+                        if (job == NULL) {
+                                fprintf(stderr, "wait: %s: no such job\n", command->args[i]);
+                                continue;
+                        }
+                        while (job->running > 0 && !job->stopped)
+                                sigsuspend(&old);
+                }
+        } else {
+                for (struct Job *job = jobs; job; job = job->next) {
+                        while (job->running > 0 && !job->stopped)
+                                sigsuspend(&old);
+                }
+        }
+        unblock_sigchld(&old);
+        report_jobs();
+}
+
+// fg, fg %n: bring a job to the foreground, continuing it if stopped
+void fg_builtin(struct Command *command) {
+        sigset_t old;
+        struct Job *job;
+
+        block_sigchld(&old);
+        job = job_from_arg(command->args[1]);
+        if (job == NULL) {
+                unblock_sigchld(&old);
+                fprintf(stderr, "fg: no such job\n");
+                return;
+        }
+        fprintf(stdout, "%s\n", job->cmdline);
+        fflush(stdout);
+        if (job->stopped) {
+                job->stopped = false;
+                kill(-job->pgid, SIGCONT);
+        }
+        job_wait(job, &old);
+        if (job->stopped) {
+                fprintf(stderr, "[%d] Stopped \'%s\'\n", job->id, job->cmdline);
+        } else {
+                job_remove(job);
+                print_completed(job);
+                last_status = exit_status(job->status[job->count - 1]);
+                job_free(job);
+        }
+        unblock_sigchld(&old);
+}
+
+// Close both ends of every pipe in the pipeline
+void close_pipes(struct Pipelines *pipeline) {
+        for (int i = 0; i < (pipeline->count - 1); i++) {
+                close(pipeline->pipes[i][0]);
+                close(pipeline->pipes[i][1]);
+        }
+}
+
+// Serve a here document or string from a memfd, rewound so that the
+// command reads it from the start. A '<<<' word gets a '\n' after it.
+int here_open(struct Redirect *redir) {
+        int fd = memfd_create("here", MFD_CLOEXEC);
+        size_t len = strlen(redir->word);
+
+        if (fd == -1)
+                return -1;
+        for (size_t done = 0; done < len; ) {
+                ssize_t written = write(fd, redir->word + done, len - done);
+                if (written == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        close(fd);
+                        return -1;
+                }
+                done += written;
+        }
+        if ((redir->kind == REDIR_HERE_STRING && write(fd, "\n", 1) != 1) ||
+            lseek(fd, 0, SEEK_SET) == -1) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+// Close what redirect_open opened, once the stages are started
+void redirect_close(struct Pipelines *pipeline) {
+        for (int i = 0; i < pipeline->count; i++) {
+                struct Command *command = &pipeline->cmds[i];
+                for (int j = 0; j < command->nredirs; j++) {
+                        if (command->redirs[j].opened != -1) {
+                                close(command->redirs[j].opened);
+                                command->redirs[j].opened = -1;
+                        }
+                }
+        }
+}
+
+// Give up on a pipeline whose pipe number count could not be made:
+// close the pipes before it and the opened redirections, and let
+// SIGCHLD through again, as no stage has started
+struct Error pipes_fail(struct Pipelines *pipeline, int count, sigset_t *old) {
+        struct Error error = { .flag = 1 };
+        int saved = errno;
+
+        for (int i = 0; i < count; i++) {
+                close(pipeline->pipes[i][0]);
+                close(pipeline->pipes[i][1]);
+        }
+        redirect_close(pipeline);
+        unblock_sigchld(old);
+        snprintf(error.msg, sizeof(error.msg), "Error: cannot create pipe: %s\n", strerror(saved));
+        return error;
+}
+
+// Open the files and here documents of every stage, close-on-exec, in
+// the shell. Nothing is started if one of them cannot be opened, or if
+// a redirection copies a descriptor that will not be open. Only the
+// descriptors below MAX_REDIRECT_FD belong to the command, the ones above
+// are the shell's.
+struct Error redirect_open(struct Pipelines *pipeline) {
+        struct Error error = {0};
+
+        for (int i = 0; i < pipeline->count; i++) {
+                struct Command *command = &pipeline->cmds[i];
+                // 1: set by an earlier redirection, -1: closed by one
+                int set[MAX_REDIRECT_FD] = {0};
+
+                for (int j = 0; j < command->nredirs; j++) {
+                        struct Redirect *redir = &command->redirs[j];
+
+                        if (redir->kind == REDIR_OPEN) {
+                                redir->opened = fd_above(open(redir->word, redir->flags | O_CLOEXEC, 0666));
+                        } else if (redir->kind == REDIR_HERE_STRING || redir->kind == REDIR_HERE_DOC) {
+                                redir->opened = fd_above(here_open(redir));
+                        } else if (redir->kind == REDIR_DUP &&
+                                   // the shell keeps its own descriptors up there
+                                   (redir->target >= MAX_REDIRECT_FD ||
+                                    (set[redir->target] != 0 ? set[redir->target] == -1 :
+                                     fcntl(redir->target, F_GETFD) == -1))) {
+                                error.flag = 1;
+                                strcpy(error.msg, "Error: bad file descriptor\n");
+                                redirect_close(pipeline);
+                                return error;
+                        }
+                        if ((redir->kind == REDIR_OPEN || redir->kind == REDIR_HERE_STRING ||
+                             redir->kind == REDIR_HERE_DOC) && redir->opened == -1) {
+                                error.flag = 1;
+                                if (redir->kind != REDIR_OPEN)
+                                        strcpy(error.msg, "Error: cannot open here document\n");
+                                else if (redir->flags == O_RDONLY)
+                                        strcpy(error.msg, "Error: cannot open input file\n");
+                                else
+                                        strcpy(error.msg, "Error: cannot open output file\n");
+                                redirect_close(pipeline);
+                                return error;
+                        }
+                        set[redir->fd] = redir->kind == REDIR_CLOSE ? -1 : 1;
+                }
+        }
+        return error;
+}
+
+// Add the redirections of a command to its launch plan, after its pipes
+void redirect_plan(struct Command *command, struct Launch *plan) {
+        for (int i = 0; i < command->nredirs; i++) {
+                struct Redirect *redir = &command->redirs[i];
+
+                if (redir->kind == REDIR_DUP)
+                        plan_dup(plan, redir->target, redir->fd);
+                else if (redir->kind == REDIR_CLOSE)
+                        plan_close(plan, redir->fd);
+                else
+                        plan_dup(plan, redir->opened, redir->fd);
+        }
+}
+
+// Whether the command's redirections end up replacing fd
+bool redirects(struct Command *command, int fd) {
+        for (int i = 0; i < command->nredirs; i++) {
+                if (command->redirs[i].fd == fd)
+                        return true;
+        }
+        return false;
+}
+
+// Whether a stage redirects a descriptor other than stdin, stdout and
+// stderr, which the pipes could be using
+bool redirects_high(struct Pipelines *pipeline) {
+        for (int i = 0; i < pipeline->count; i++) {
+                for (int fd = STDERR_FILENO + 1; fd < MAX_REDIRECT_FD; fd++) {
+                        if (redirects(&pipeline->cmds[i], fd))
+                                return true;
+                }
+        }
+        return false;
+}
+
+// A builtin run in the shell used what the shell used meanwhile: turn
+// after into the difference from before
+void usage_since(const struct rusage *before, struct rusage *after) {
+        timersub(&after->ru_utime, &before->ru_utime, &after->ru_utime);
+        timersub(&after->ru_stime, &before->ru_stime, &after->ru_stime);
+        after->ru_nvcsw -= before->ru_nvcsw;
+        after->ru_nivcsw -= before->ru_nivcsw;
+}
+
+// Apply a launch plan to the shell itself, keeping a copy of every
+// descriptor it replaces. SIGPIPE is ignored meanwhile, so that a reader
+// going away makes the builtin fail with EPIPE instead of killing the
+// shell. The copies are above the descriptors a redirection can name.
+void stdio_redirect(struct Launch *plan, struct StdioSave *saved) {
+        struct sigaction ignore;
+
+        fflush(stdout);
+        fflush(stderr);
+        saved->count = 0;
+        for (int i = 0; i < plan->nactions; i++) {
+                struct FdAction *action = &plan->actions[i];
+                int fd = action->kind == FD_DUP ? action->target : action->fd;
+                bool known = false;
+
+                for (int j = 0; j < saved->count; j++)
+                        known = known || saved->fds[j] == fd;
+                if (!known) {
+                        saved->fds[saved->count] = fd;
+                        saved->copies[saved->count] = fcntl(fd, F_DUPFD_CLOEXEC, MAX_REDIRECT_FD);
+                        saved->count++;
+                }
+                if (action->kind == FD_DUP)
+                        dup2(action->fd, action->target);
+                else
+                        close(action->fd);
+        }
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore, &saved->sigpipe);
+}
+
+void stdio_restore(struct StdioSave *saved) {
+        fflush(stdout);
+        fflush(stderr);
+        clearerr(stdout);
+        for (int i = 0; i < saved->count; i++) {
+                if (saved->copies[i] == -1) {
+                        close(saved->fds[i]);
+                        continue;
+                }
+                dup2(saved->copies[i], saved->fds[i]);
+                close(saved->copies[i]);
+        }
+        sigaction(SIGPIPE, &saved->sigpipe, NULL);
+}
+
+// The pipeline as typed, while a builtin runs in the shell, for a
+// builtin that starts a job of its own
+static char *builtin_text;
+
+// Run a builtin in the shell itself. Its redirections are applied to
+// the shell while it runs, then the shell's own descriptors are put back.
+struct Error run_builtin(const struct Builtin *builtin, struct Pipelines *pipeline) {
+        struct Launch plan = { .nactions = 0, .pgid = 0 };
+        struct StdioSave saved;
+        int status;
+        struct timespec start, end;
+        struct rusage before, after;
+        uint64_t dispatched;
+        struct Error error;
+
+        error = redirect_open(pipeline);
+        if (error.flag == 1)
+                return error;
+
+        redirect_plan(&pipeline->cmds[0], &plan);
+        stdio_redirect(&plan, &saved);
+        redirect_close(pipeline);
+
+        if (pipeline->timed) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                getrusage(RUSAGE_SELF, &before);
+        }
+        dispatched = clock_ns();
+        builtin_text = pipeline->text;
+        status = builtin->fn(&pipeline->cmds[0]);
+        builtin_text = NULL;
+        stat_builtin(&pipeline->cmds[0], status, dispatched);
+        if (pipeline->timed) {
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                getrusage(RUSAGE_SELF, &after);
+        }
+
+        stdio_restore(&saved);
+        if (builtin->utility && !quiet)
+                fprintf(stderr, "+ completed \'%s\' [%d]\n", pipeline->text, status);
+        if (pipeline->timed) {
+                usage_since(&before, &after);
+                fprintf(stderr, "+ time \'%s\'\n", pipeline->text);
+                print_usage("total", timespec_seconds(&end) - timespec_seconds(&start), &after);
+        }
+        last_status = status;
+        return error;
+}
+
+// Give a pipe the capacity asked for, 0 to keep the kernel's. The kernel
+// rounds it up to a power of two pages, and an unprivileged user cannot
+// go over /proc/sys/fs/pipe-max-size; the pipe then keeps its size.
+void pipe_resize(int fds[2], int size) {
+        if (size == 0)
+                return;
+        if (fcntl(fds[1], F_SETPIPE_SZ, size) == -1)
+                fprintf(stderr, "pipesize: %s\n", strerror(errno));
+}
+
+// Run every stage of the pipeline at the same time in one process group.
+// A single command is a pipeline of one stage. Each child keeps only its
+// own stdin/stdout pipe ends, then applies its redirections, and the
+// parent closes all the pipes and files once every stage is started. A
+// foreground pipeline is waited for and all exit statuses are reported
+// on one line. A background pipeline is left in the job table and
+// reported at a later prompt.
+struct Error run_pipeline(struct Pipelines *pipeline) {
+        pid_t *pids = pipeline->pids;
+        int *status = pipeline->status;
+        struct Job job = {0};
+        sigset_t old;
+        pid_t pgid = 0;
+        int last = pipeline->count - 1;
+        int inprocess = -1;
+        const struct Builtin *inprocess_builtin = NULL;
+        struct Launch inprocess_plan;
+        bool high;
+        struct Error error;
+
+        error = redirect_open(pipeline);
+        if (error.flag == 1)
+                return error;
+
+        // no child may be reaped before its job is in the table
+        block_sigchld(&old);
+        job.cmdline = pipeline->text;
+        job.pids = pids;
+        job.status = status;
+        job.usage = pipeline->usage;
+        job.timed = pipeline->timed;
+        clock_gettime(CLOCK_MONOTONIC, &job.start);
+        job.count = pipeline->count;
+
+        // generate pipes, close-on-exec so that a child only keeps
+        // the ends its plan dup2s onto stdin and stdout
+        high = redirects_high(pipeline);
+        for (int i = 0; i < last; i++) {
+                if (pipe2(pipeline->pipes[i], O_CLOEXEC) == -1)
+                        return pipes_fail(pipeline, i, &old);
+                if (high) {
+                        pipeline->pipes[i][0] = fd_above(pipeline->pipes[i][0]);
+                        pipeline->pipes[i][1] = fd_above(pipeline->pipes[i][1]);
+                        if (pipeline->pipes[i][0] == -1 || pipeline->pipes[i][1] == -1) {
+                                close(pipeline->pipes[i][0]);
+                                close(pipeline->pipes[i][1]);
+                                return pipes_fail(pipeline, i, &old);
+                        }
+                }
+                pipe_resize(pipeline->pipes[i], pipeline->pipesize ? pipeline->pipesize : pipe_size);
+        }
+        if (last > 0)
+                job.pipesize = fcntl(pipeline->pipes[0][1], F_GETPIPE_SZ);
+
+        for (int i = 0; i < pipeline->count; i++) {
+                struct Launch plan = { .nactions = 0, .pgid = pgid };
+                const struct Builtin *builtin;
+
+                if (i != 0)
+                        plan_dup(&plan, pipeline->pipes[i-1][0], STDIN_FILENO);
+                if (i != last)
+                        plan_dup(&plan, pipeline->pipes[i][1], STDOUT_FILENO);
+                redirect_plan(&pipeline->cmds[i], &plan);
+                if (pipeline->cmds[i].limits)
+                        plan.limits = *pipeline->cmds[i].limits;
+
+                builtin = find_builtin(&pipeline->cmds[i]);
+                // the shell runs one data moving stage itself, once the
+                // others are started, unless it has limits. Not with job
+                // control: the shell would be stuck copying while the
+                // other stages are stopped.
+                if (builtin && builtin->stage && inprocess == -1 && pipeline->count > 1 &&
+                    !pipeline->background && !pipeline->cmds[i].limits &&
+                    !isatty(STDIN_FILENO)) {
+                        inprocess = i;
+                        inprocess_builtin = builtin;
+                        inprocess_plan = plan;
+                        pids[i] = -1;
+                        continue;
+                }
+                if (builtin && builtin->utility)
+                        pids[i] = launch_builtin(builtin, &pipeline->cmds[i], &plan);
+                else
+                        pids[i] = launch(&pipeline->cmds[i], &plan);
+                if (pids[i] == -1) {
+                        if (errno == EAGAIN || errno == ENOMEM)
+                                perror("fork");
+                        else
+                                exec_error(STDERR_FILENO, pipeline->cmds[i].cmd, errno);
+                        status[i] = 1 << 8;
+                } else {
+                        stage_started(&pipeline->usage[i], pids[i]);
+                        if (pgid == 0)
+                                pgid = pids[i];
+                        job.running++;
+                }
+        }
+        if (inprocess != -1) {
+                struct StdioSave saved;
+                struct rusage before;
+                uint64_t start;
+
+                // the children must see the end of their pipes when the
+                // stage is done, so the shell only keeps the stage's
+                // ends, as stdin and stdout
+                stdio_redirect(&inprocess_plan, &saved);
+                close_pipes(pipeline);
+                redirect_close(pipeline);
+                if (pgid != 0)
+                        set_foreground(pgid);
+                getrusage(RUSAGE_SELF, &before);
+                start = clock_ns();
+                status[inprocess] = inprocess_builtin->fn(&pipeline->cmds[inprocess]) << 8;
+                stat_builtin(&pipeline->cmds[inprocess], WEXITSTATUS(status[inprocess]), start);
+                getrusage(RUSAGE_SELF, &pipeline->usage[inprocess].usage);
+                clock_gettime(CLOCK_MONOTONIC, &pipeline->usage[inprocess].end);
+                usage_since(&before, &pipeline->usage[inprocess].usage);
+                stdio_restore(&saved);
+        } else {
+                close_pipes(pipeline);
+                redirect_close(pipeline);
+        }
+
+        job.pgid = pgid;
+        job_add(&job);
+        if (pipeline->background) {
+                job_detach(&job);
+                unblock_sigchld(&old);
+                last_status = 0;
+                return error;
+        }
+
+        // hand the terminal to the pipeline while it runs
+        job_wait(&job, &old);
+        if (job.stopped) {
+                struct Job *stopped = job_detach(&job);
+                fprintf(stderr, "[%d] Stopped \'%s\'\n", stopped->id, stopped->cmdline);
+                last_status = 128 + SIGTSTP;
+        } else {
+                job_remove(&job);
+                print_completed(&job);
+                last_status = exit_status(status[last]);
+        }
+        unblock_sigchld(&old);
+        return error;
+}
+
+// The directory stack, and every path it ever held
+static struct DirStack dir_stack;
+static struct InternEntry *intern_table[HASH_BUCKETS];
+
+const char *intern_path(const char *path) {
+        unsigned index = hash_index(path);
+        struct InternEntry *entry;
+
+        for (entry = intern_table[index]; entry; entry = entry->next) {
+                if (!strcmp(entry->path, path))
+                        return entry->path;
+        }
+        entry = malloc(sizeof(struct InternEntry));
+        entry->path = strdup(path);
+        entry->next = intern_table[index];
+        intern_table[index] = entry;
+        return entry->path;
+}
+
+// Join path to the directory base, and remove the "." and ".." in it,
+// without following symbolic links. out has PATH_MAX bytes.
+// Returns -1 if the result is too long.
+int resolve_path(const char *base, const char *path, char *out) {
+        size_t len = 0;
+
+        if (*path != '/') {
+                len = strlen(base);
+                if (len >= PATH_MAX)
+                        return -1;
+                memcpy(out, base, len);
+                // the root is "/", which must not end in a '/' here
+                if (len == 1)
+                        len = 0;
+        }
+        while (*path) {
+                const char *end = strchrnul(path, '/');
+                size_t part = end - path;
+
+                if (part == 0 || (part == 1 && path[0] == '.')) {
+                        // nothing to add
+                } else if (part == 2 && path[0] == '.' && path[1] == '.') {
+                        while (len > 0 && out[len - 1] != '/')
+                                len--;
+                        if (len > 0)
+                                len--;
+                } else {
+                        if (len + part + 2 > PATH_MAX)
+                                return -1;
+                        out[len++] = '/';
+                        memcpy(out + len, path, part);
+                        len += part;
+                }
+                path = *end ? end + 1 : end;
+        }
+        if (len == 0)
+                out[len++] = '/';
+        out[len] = '\0';
+        return 0;
+}
+
+const char *dir_top(void) {
+        return dir_stack.dirs[dir_stack.count - 1];
+}
+
+void dir_push(const char *path) {
+        if (dir_stack.count == dir_stack.cap) {
+                dir_stack.cap = dir_stack.cap ? dir_stack.cap * 2 : 16;
+                dir_stack.dirs = realloc(dir_stack.dirs, dir_stack.cap * sizeof(char *));
+        }
+        dir_stack.dirs[dir_stack.count++] = path;
+}
+
+void dirs_init(void) {
+        char cwd[PATH_MAX];
+
+        if (getcwd(cwd, sizeof(cwd)) == NULL)
+                strcpy(cwd, "/");
+        dir_push(intern_path(cwd));
+        setenv("PWD", cwd, 1);
+}
+
+// Change to a directory, relative to the logical current directory.
+// Returns its interned path, or NULL if it cannot be entered.
+const char *enter_dir(const char *path) {
+        char target[PATH_MAX];
+
+        if (resolve_path(dir_top(), path, target) == -1 || chdir(target) == -1) {
+                fprintf(stderr, "Directory not found: %s\n", path);
+                return NULL;
+        }
+        setenv("PWD", target, 1);
+        return intern_path(target);
+}
+
+// Reverse the entries from first to last, both included
+void dirs_reverse(int first, int last) {
+        while (first < last) {
+                const char *tmp = dir_stack.dirs[first];
+                dir_stack.dirs[first++] = dir_stack.dirs[last];
+                dir_stack.dirs[last--] = tmp;
+        }
+}
+
+// Open the history file: $SSHELL_HISTFILE, else ~/.sshell_history. An
+// empty SSHELL_HISTFILE turns the history off. Nothing is read until the
+// history is first searched.
+void history_open(void) {
+        const char *path = getenv("SSHELL_HISTFILE");
+        char buf[PATH_MAX];
+
+        if (path == NULL) {
+                const char *home = getenv("HOME");
+
+                if (home == NULL)
+                        return;
+                snprintf(buf, sizeof(buf), "%s/.sshell_history", home);
+                path = buf;
+        }
+        if (*path == '\0')
+                return;
+        history.fd = fd_above(open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+}
+
+// Add a line to the file. Blank lines are left out.
+void history_add(const char *line) {
+        struct iovec iov[2] = {
+                { (void *)line, strlen(line) },
+                { "\n", 1 },
+        };
+
+        if (history.fd == -1 || line[strspn(line, " \t")] == '\0')
+                return;
+        if (writev(history.fd, iov, 2) == -1)
+                perror("history");
+}
+
+// Map the whole file as it is now. It only grows, so the mapping is only
+// extended, unless another program cut it and everything is read again.
+bool history_map(void) {
+        struct stat st;
+        size_t size;
+        char *data;
+
+        if (history.fd == -1 || fstat(history.fd, &st) == -1)
+                return false;
+        size = st.st_size;
+        if (size < history.indexed) {
+                history.count = 0;
+                history.nsigs = 0;
+                history.indexed = 0;
+                history.nsorted = 0;
+                history.sorted_upto = 0;
+        }
+        if (size == history.mapped)
+                return true;
+        if (size == 0)
+                data = NULL;
+        else if (history.mapped == 0)
+                data = mmap(NULL, size, PROT_READ, MAP_SHARED, history.fd, 0);
+        else
+                data = mremap(history.data, history.mapped, size, MREMAP_MAYMOVE);
+        if (data == MAP_FAILED) {
+                perror("history");
+                return false;
+        }
+        if (size == 0 && history.mapped)
+                munmap(history.data, history.mapped);
+        history.data = data;
+        history.mapped = size;
+        return true;
+}
+
+// The bytes an entry spans, without its '\n'
+size_t history_len(int i) {
+        size_t end = i + 1 < history.count ? history.lines[i + 1] : history.indexed;
+
+        return end - history.lines[i] - 1;
+}
+
+// One bit per hash of each three bytes in a row. A text can only
+// contain another if its bits include the other's.
+uint64_t history_sig(const char *text, size_t len) {
+        const unsigned char *p = (const unsigned char *)text;
+        uint64_t sig = 0;
+
+        for (size_t i = 0; i + 2 < len; i++)
+                sig |= 1ULL << (((p[i] * 961u + p[i + 1] * 31u + p[i + 2]) * 2654435761u) >> 26);
+        return sig;
+}
+
+// Index the entries written since the last time, by any session. Only
+// whole lines are taken, a line being written is taken next time.
+bool history_index(void) {
+        char *end;
+        char *p;
+
+        if (!history_map())
+                return false;
+        end = history.data + history.mapped;
+        p = history.data + history.indexed;
+        while (p < end) {
+                char *nl = memchr(p, '\n', end - p);
+
+                if (nl == NULL)
+                        break;
+                if (history.count == history.cap) {
+                        history.cap = history.cap ? history.cap * 2 : 1024;
+                        history.lines = realloc(history.lines, history.cap * sizeof(size_t));
+                        history.sigs = realloc(history.sigs, history.cap * sizeof(uint64_t));
+                }
+                history.lines[history.count++] = p - history.data;
+                p = nl + 1;
+        }
+        history.indexed = p - history.data;
+        return true;
+}
+
+// An entry while sorting, with 8 of its bytes as a number, so that most
+// comparisons do not read the file
+struct HistoryKey {
+        uint64_t key;
+        int entry;
+};
+
+int history_compare(const void *a, const void *b) {
+        const struct HistoryKey *x = a, *y = b;
+
+        if (x->key != y->key)
+                return x->key < y->key ? -1 : 1;
+        return x->entry - y->entry;
+}
+
+// Sort by key, keeping the order of entries with the same key, one pass
+// per byte from the lowest. The bytes every key has the same are skipped.
+void history_radix(struct HistoryKey *keys, struct HistoryKey *tmp, int count) {
+        for (int shift = 0; shift < 64; shift += 8) {
+                int offsets[257] = {0};
+
+                for (int i = 0; i < count; i++)
+                        offsets[(keys[i].key >> shift & 255) + 1]++;
+                if (offsets[(keys[0].key >> shift & 255) + 1] == count)
+                        continue;
+                for (int b = 1; b < 257; b++)
+                        offsets[b] += offsets[b - 1];
+                for (int i = 0; i < count; i++)
+                        tmp[offsets[keys[i].key >> shift & 255]++] = keys[i];
+                memcpy(keys, tmp, count * sizeof(struct HistoryKey));
+        }
+}
+
+// Sort entries by text, then by number, 8 bytes at a time from depth:
+// by those bytes first, then each run where they are the same by the
+// next 8. Past its end, an entry reads as '\0' bytes. keys start in the
+// order of their entries, and tmp is as large as keys.
+void history_sort_keys(struct HistoryKey *keys, struct HistoryKey *tmp, int count, size_t depth) {
+        for (int i = 0; i < count; i++) {
+                const unsigned char *text = (const unsigned char *)history.data +
+                        history.lines[keys[i].entry];
+                size_t len = history_len(keys[i].entry);
+
+                keys[i].key = 0;
+                for (size_t k = depth; k < depth + 8; k++)
+                        keys[i].key = keys[i].key << 8 | (k < len ? text[k] : 0);
+        }
+        if (count < 64)
+                qsort(keys, count, sizeof(struct HistoryKey), history_compare);
+        else
+                history_radix(keys, tmp, count);
+        for (int i = 0, j; i < count; i = j) {
+                bool longer = false;
+
+                for (j = i; j < count && keys[j].key == keys[i].key; j++)
+                        longer = longer || history_len(keys[j].entry) > depth + 8;
+                if (longer && j - i > 1)
+                        history_sort_keys(keys + i, tmp + i, j - i, depth + 8);
+        }
+}
+
+bool history_same(int i, int j) {
+        return history_len(i) == history_len(j) &&
+                !memcmp(history.data + history.lines[i], history.data + history.lines[j], history_len(i));
+}
+
+// Sort every entry indexed so far by text, keeping the latest of each
+// distinct text, so that the entries starting with a prefix are next to
+// each other and found by a binary search. The latest entry of each
+// block of HISTORY_BLOCK is kept too, to find the latest of many.
+void history_sort(void) {
+        struct HistoryKey *keys = malloc(history.count * sizeof(struct HistoryKey));
+        struct HistoryKey *tmp = malloc(history.count * sizeof(struct HistoryKey));
+        int kept = 0;
+
+        for (int i = 0; i < history.count; i++)
+                keys[i].entry = i;
+        history_sort_keys(keys, tmp, history.count, 0);
+        free(tmp);
+        history.sorted = realloc(history.sorted, history.count * sizeof(int));
+        for (int i = 0; i < history.count; i++) {
+                if (kept > 0 && history_same(history.sorted[kept - 1], keys[i].entry))
+                        kept--;
+                history.sorted[kept++] = keys[i].entry;
+        }
+        free(keys);
+        history.nsorted = kept;
+        history.sorted_upto = history.count;
+
+        history.latest = realloc(history.latest, (kept / HISTORY_BLOCK + 1) * sizeof(int));
+        for (int i = 0; i < kept; i++) {
+                if (i % HISTORY_BLOCK == 0 || history.sorted[i] > history.latest[i / HISTORY_BLOCK])
+                        history.latest[i / HISTORY_BLOCK] = history.sorted[i];
+        }
+}
+
+// Where an entry is from the ones starting with prefix: below them (< 0),
+// one of them (0) or above them (> 0)
+int history_prefix_compare(int i, const char *prefix, size_t len) {
+        size_t elen = history_len(i);
+        int diff = memcmp(history.data + history.lines[i], prefix, elen < len ? elen : len);
+
+        if (diff == 0 && elen < len)
+                return -1;
+        return diff;
+}
+
+// The first sorted entry from lo not below the prefix, or with above,
+// the first one above it
+int history_search(const char *prefix, size_t len, int lo, bool above) {
+        int hi = history.nsorted;
+
+        while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                int diff = history_prefix_compare(history.sorted[mid], prefix, len);
+
+                if (diff < 0 || (above && diff == 0))
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+// The latest entry starting with prefix, or -1. The entries added since
+// the sort are looked at one by one, the others found by two binary
+// searches. Once too many were added, everything is sorted again.
+int history_find_prefix(const char *prefix, size_t len) {
+        int found = -1;
+        int lo, hi;
+
+        if (!history_index())
+                return -1;
+        if (history.count - history.sorted_upto > HISTORY_RECENT)
+                history_sort();
+        for (int i = history.count - 1; i >= history.sorted_upto; i--) {
+                if (history_prefix_compare(i, prefix, len) == 0)
+                        return i;
+        }
+
+        lo = history_search(prefix, len, 0, false);
+        hi = history_search(prefix, len, lo, true);
+        for (; lo < hi && lo % HISTORY_BLOCK; lo++) {
+                if (history.sorted[lo] > found)
+                        found = history.sorted[lo];
+        }
+        for (; lo + HISTORY_BLOCK <= hi; lo += HISTORY_BLOCK) {
+                if (history.latest[lo / HISTORY_BLOCK] > found)
+                        found = history.latest[lo / HISTORY_BLOCK];
+        }
+        for (; lo < hi; lo++) {
+                if (history.sorted[lo] > found)
+                        found = history.sorted[lo];
+        }
+        return found;
+}
+
+// Compute the signatures of the entries indexed since the last search
+// for a text
+void history_sign(void) {
+        for (; history.nsigs < history.count; history.nsigs++)
+                history.sigs[history.nsigs] = history_sig(history.data + history.lines[history.nsigs],
+                                                          history_len(history.nsigs));
+}
+
+// Whether entry i contains text, whose signature is sig
+bool history_contains(int i, const char *text, size_t len, uint64_t sig) {
+        return (history.sigs[i] & sig) == sig &&
+                memmem(history.data + history.lines[i], history_len(i), text, len);
+}
+
+// The latest entry containing text, or -1
+int history_find_text(const char *text, size_t len) {
+        uint64_t sig = history_sig(text, len);
+
+        if (!history_index())
+                return -1;
+        history_sign();
+        for (int i = history.count - 1; i >= 0; i--) {
+                if (history_contains(i, text, len, sig))
+                        return i;
+        }
+        return -1;
+}
+
+// The last line of the file, for "!!", found without indexing it
+bool history_last(const char **text, size_t *len) {
+        const char *end;
+        const char *start;
+
+        if (!history_map() || history.mapped == 0 || history.data[history.mapped - 1] != '\n')
+                return false;
+        end = history.data + history.mapped - 1;
+        start = memrchr(history.data, '\n', end - history.data);
+        start = start ? start + 1 : history.data;
+        *text = start;
+        *len = end - start;
+        return true;
+}
+
+// Find the entry a "!" reference names. p is after the '!', and is moved
+// past the reference.
+bool history_event(const char **p, const char **text, size_t *len) {
+        const char *s = *p;
+        int i;
+
+        if (*s == '!') {
+                *p = s + 1;
+                return history_last(text, len);
+        }
+        if (*s == '?') {
+                size_t n = strcspn(s + 1, "?");
+
+                i = history_find_text(s + 1, n);
+                *p = s + 1 + n + (s[1 + n] == '?');
+        } else if ((*s >= '0' && *s <= '9') || (*s == '-' && s[1] >= '0' && s[1] <= '9')) {
+                char *end;
+                long n = strtol(s, &end, 10);
+
+                *p = end;
+                if (!history_index())
+                        return false;
+                i = n < 0 ? history.count + n : n - 1;
+                if (i < 0 || i >= history.count)
+                        return false;
+        } else {
+                size_t n = 0;
+
+                while (!is_meta(s[n]) && s[n] != '(' && s[n] != ')')
+                        n++;
+                i = history_find_prefix(s, n);
+                *p = s + n;
+        }
+        if (i < 0)
+                return false;
+        *text = history.data + history.lines[i];
+        *len = history_len(i);
+        return true;
+}
+
+// Replace the history references in a line: "!!" the last entry, "!N"
+// entry N, "!-N" the Nth from the end, "!?text" the latest containing
+// text and "!text" the latest starting with it. A '!' followed by a
+// blank, '=', '(' or '"', or within single quotes, is left as it is.
+// The line is only copied into the arena when it has a reference.
+struct Error history_expand(struct Arena *arena, char **line) {
+        struct Error error = {0};
+        struct StrBuf buf;
+        const char *p = *line;
+        const char *copied = *line;
+        bool quoted = false;
+        bool expanded = false;
+
+        for (; *p; p++) {
+                const char *text;
+                size_t len;
+
+                if (*p == '\'') {
+                        quoted = !quoted;
+                } else if (*p == '\\' && !quoted && p[1]) {
+                        p++;
+                } else if (*p == '!' && !quoted && !is_meta(p[1]) && !strchr("=(\"", p[1])) {
+                        const char *ref = p + 1;
+
+                        if (!expanded)
+                                strbuf_init(&buf, arena, strlen(*line) + 64);
+                        expanded = true;
+                        if (!history_event(&ref, &text, &len)) {
+                                error.flag = 1;
+                                snprintf(error.msg, sizeof(error.msg), "Error: %.*s: event not found\n",
+                                         (int)(ref - p), p);
+                                return error;
+                        }
+                        strbuf_add(&buf, copied, p - copied);
+                        strbuf_add(&buf, text, len);
+                        copied = ref;
+                        p = ref - 1;
+                }
+        }
+        if (expanded) {
+                strbuf_add(&buf, copied, p - copied);
+                *line = buf.data;
+        }
+        return error;
+}
+
+// history: list the entries, numbered from 1
+// history N: the last N entries
+// history TEXT: the entries containing TEXT
+int builtin_history(struct Command *command) {
+        const char *arg = command->args[1];
+        int first = 0;
+        uint64_t sig = 0;
+        size_t len = 0;
+        char *end;
+
+        if (!history_index())
+                return history.fd == -1 ? 1 : 0;
+        if (arg) {
+                long n = strtol(arg, &end, 10);
+
+                if (*end == '\0' && n >= 0) {
+                        first = n < history.count ? history.count - n : 0;
+                        arg = NULL;
+                } else {
+                        len = strlen(arg);
+                        sig = history_sig(arg, len);
+                        history_sign();
+                }
+        }
+        for (int i = first; i < history.count; i++) {
+                if (arg && !history_contains(i, arg, len, sig))
+                        continue;
+                fprintf(stdout, "%5d  %.*s\n", i + 1, (int)history_len(i),
+                        history.data + history.lines[i]);
+        }
+        return 0;
+}
+
+// stats: the times of the shell's own work, in microseconds. The
+// percentiles are within a quarter of a power of two.
+// stats -r: start them over
+int builtin_stats(struct Command *command) {
+        if (command->args[1] && !strcmp(command->args[1], "-r")) {
+                memset(stats, 0, sizeof(stats));
+                return 0;
+        }
+        fprintf(stdout, "%-8s %9s %12s %10s %10s %10s %10s\n",
+                "stat", "count", "total_ms", "mean_us", "p50_us", "p99_us", "max_us");
+        for (int i = 0; i < STAT_KINDS; i++) {
+                const struct Stat *stat = &stats[i];
+
+                fprintf(stdout, "%-8s %9llu %12.3f %10.1f %10.1f %10.1f %10.1f\n", stat_names[i],
+                        (unsigned long long)stat->count, stat->total / 1e6,
+                        stat->count ? stat->total / 1e3 / stat->count : 0,
+                        stat_percentile(stat, 0.5) / 1e3, stat_percentile(stat, 0.99) / 1e3,
+                        stat->max / 1e3);
+        }
+        return 0;
+}
+
+int builtin_exit(struct Command *command) {
+        (void)command;
+        if (jobs_running()) {
+                fprintf(stderr, "Error: active job still running\n");
+                if (!quiet)
+                        fprintf(stderr, "+ completed 'exit' [1]\n");
+                return 1;
+        }
+        fprintf(stderr, "Bye...\n");
+        if (!quiet)
+                fprintf(stderr, "+ completed 'exit' [0]\n");
+        exit(EXIT_SUCCESS);
+}
+
+int builtin_pwd(struct Command *command) {
+        (void)command;
+        fprintf(stdout, "%s\n", dir_top());
+        return 0;
+}
+
+// cd [dir]: no dir or "~" is $HOME, and "~/" starts a path in $HOME
+int builtin_cd(struct Command *command) {
+        char path[PATH_MAX];
+        const char *home = getenv("HOME");
+        const char *dir;
+
+        if (command->argc > 2) {
+                fprintf(stderr, "err: Failed to cd, incorrect number of arguments.\n");
+                return 1;
+        }
+        if (home == NULL)
+                home = "/";
+        if (command->args[1] == NULL || !strcmp(command->args[1], "~")) {
+                snprintf(path, sizeof(path), "%s", home);
+        } else if (!strncmp(command->args[1], "~/", 2)) {
+                snprintf(path, sizeof(path), "%s%s", home, command->args[1] + 1);
+        } else {
+                snprintf(path, sizeof(path), "%s", command->args[1]);
+        }
+        dir = enter_dir(path);
+        if (dir == NULL)
+                return 1;
+        dir_stack.dirs[dir_stack.count - 1] = dir;
+        return 0;
+}
+
+int builtin_hash(struct Command *command) {
+        hash_builtin(command);
+        return 0;
+}
+
+int builtin_jobs(struct Command *command) {
+        (void)command;
+        jobs_builtin();
+        return 0;
+}
+
+int builtin_wait(struct Command *command) {
+        wait_builtin(command);
+        return 0;
+}
+
+int builtin_fg(struct Command *command) {
+        fg_builtin(command);
+        return 0;
+}
+
+// Read a size: a number of bytes, or of kB, MB or GB with a k, M or G
+// after it. Returns -1 if it is not one.
+long long parse_bytes(const char *text) {
+        char *end;
+        long long size;
+        int shift = 0;
+
+        errno = 0;
+        size = strtoll(text, &end, 10);
+        if (end == text || size < 0 || errno)
+                return -1;
+        if (*end == 'k' || *end == 'K')
+                shift = 10;
+        else if (*end == 'm' || *end == 'M')
+                shift = 20;
+        else if (*end == 'g' || *end == 'G')
+                shift = 30;
+        if (shift) {
+                if (size > LLONG_MAX >> shift)
+                        return -1;
+                size <<= shift;
+                end++;
+        }
+        return *end == '\0' ? size : -1;
+}
+
+// As parse_bytes, for a size that must fit an int
+int parse_size(const char *text) {
+        long long size = parse_bytes(text);
+
+        return size > INT_MAX ? -1 : size;
+}
+
+// set: show the shell's options
+// set name=value...: change them
+// pipesize: capacity of the pipes between stages, 0 for the default
+int builtin_set(struct Command *command) {
+        if (command->args[1] == NULL) {
+                fprintf(stdout, "pipesize=%d\n", pipe_size);
+                return 0;
+        }
+        for (int i = 1; command->args[i]; i++) {
+                const char *arg = command->args[i];
+                int size;
+
+                if (strncmp(arg, "pipesize=", 9)) {
+                        fprintf(stderr, "set: %s: unknown option\n", arg);
+                        return 1;
+                }
+                size = parse_size(arg + 9);
+                if (size == -1) {
+                        fprintf(stderr, "set: %s: invalid size\n", arg + 9);
+                        return 1;
+                }
+                pipe_size = size;
+        }
+        return 0;
+}
+
+// pushd dir: change to dir, and push it
+// pushd: swap the two top directories
+// pushd +N: rotate the stack, so that the Nth directory from the top,
+// counting from 0, is on top
+int builtin_pushd(struct Command *command) {
+        int top = dir_stack.count - 1;
+        const char *dir;
+
+        if (command->args[1] == NULL) {
+                if (dir_stack.count < 2) {
+                        fprintf(stderr, "pushd: no other directory\n");
+                        return 1;
+                }
+                if (enter_dir(dir_stack.dirs[top - 1]) == NULL)
+                        return 1;
+                dirs_reverse(top - 1, top);
+                return 0;
+        }
+        if (command->args[1][0] == '+' && command->args[1][1] != '\0') {
+                char *end;
+                long n = strtol(command->args[1] + 1, &end, 10);
+
+                if (*end != '\0' || n < 0 || n > top) {
+                        fprintf(stderr, "pushd: %s: directory stack index out of range\n", command->args[1]);
+                        return 1;
+                }
+                if (n == 0)
+                        return 0;
+                if (enter_dir(dir_stack.dirs[top - n]) == NULL)
+                        return 1;
+                // rotating the top-first list left by n rotates the
+                // array right by n
+                dirs_reverse(0, top);
+                dirs_reverse(0, n - 1);
+                dirs_reverse(n, top);
+                return 0;
+        }
+        dir = enter_dir(command->args[1]);
+        if (dir == NULL)
+                return 1;
+        dir_push(dir);
+        return 0;
+}
+
+int builtin_popd(struct Command *command) {
+        (void)command;
+        if (dir_stack.count == 1) {
+                fprintf(stdout, "Unable to pop\n");
+                return 1;
+        }
+        // the top stays if the directory below it cannot be entered
+        if (enter_dir(dir_stack.dirs[dir_stack.count - 2]) == NULL)
+                return 1;
+        dir_stack.count--;
+        return 0;
+}
+
+// dirs: print the stack, top first
+// dirs -v: with the index of each directory
+int builtin_dirs(struct Command *command) {
+        bool verbose = command->args[1] && !strcmp(command->args[1], "-v");
+
+        for (int i = dir_stack.count - 1; i >= 0; i--) {
+                if (verbose)
+                        fprintf(stdout, "%2d  %s\n", dir_stack.count - 1 - i, dir_stack.dirs[i]);
+                else
+                        fprintf(stdout, "%s\n", dir_stack.dirs[i]);
+        }
+        return 0;
+}
+
+int builtin_true(struct Command *command) {
+        (void)command;
+        return 0;
+}
+
+int builtin_false(struct Command *command) {
+        (void)command;
+        return 1;
+}
+
+// echo [-neE] args...: -n leaves out the newline, -e reads the
+// escapes of printf in the arguments, "\c" stopping the output, and -E
+// turns them off again. An argument with other letters is printed.
+int builtin_echo(struct Command *command) {
+        int i = 1;
+        bool newline = true;
+        bool escapes = false;
+
+        for (; command->args[i] && command->args[i][0] == '-' && command->args[i][1]; i++) {
+                const char *flag = command->args[i] + 1;
+
+                if (flag[strspn(flag, "neE")] != '\0')
+                        break;
+                for (; *flag; flag++) {
+                        if (*flag == 'n')
+                                newline = false;
+                        else
+                                escapes = *flag == 'e';
+                }
+        }
+        for (int first = i; command->args[i]; i++) {
+                if (i > first)
+                        fputc(' ', stdout);
+                if (!escapes) {
+                        fputs(command->args[i], stdout);
+                        continue;
+                }
+                for (const char *p = command->args[i]; *p; p++) {
+                        if (*p != '\\') {
+                                fputc(*p, stdout);
+                        } else if (p[1] == 'c') {
+                                return 0;
+                        } else if (p[1] == '0') {
+                                // "\0NNN", where printf has "\NNN"
+                                int value = 0;
+
+                                p++;
+                                for (int n = 0; n < 3 && p[1] >= '0' && p[1] <= '7'; n++, p++)
+                                        value = value * 8 + (p[1] - '0');
+                                fputc(value, stdout);
+                        } else {
+                                print_escape(&p);
+                        }
+                }
+        }
+        if (newline)
+                fputc('\n', stdout);
+        return 0;
+}
+
+// Whether op is one of the unary tests
+bool test_is_unary(const char *op) {
+        return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("zntrwxefdsLhpSbcugk", op[1]);
+}
+
+// Whether op is one of the binary tests
+bool test_is_binary(const char *op) {
+        static const char *ops[] = { "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                                     "-nt", "-ot", "-ef" };
+
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+                if (!strcmp(op, ops[i]))
+                        return true;
+        }
+        return false;
+}
+
+// Evaluate a unary test, e.g. -f file
+int test_unary(const char *op, const char *arg) {
+        struct stat st;
+
+        if (!test_is_unary(op))
+                return -1;
+        switch (op[1]) {
+        case 'z':
+                return *arg == '\0';
+        case 'n':
+                return *arg != '\0';
+        case 't':
+                return isatty(atoi(arg));
+        case 'r':
+                return access(arg, R_OK) == 0;
+        case 'w':
+                return access(arg, W_OK) == 0;
+        case 'x':
+                return access(arg, X_OK) == 0;
+        case 'L':
+        case 'h':
+                return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        }
+        if (stat(arg, &st) == -1)
+                return 0;
+        switch (op[1]) {
+        case 'f':
+                return S_ISREG(st.st_mode);
+        case 'd':
+                return S_ISDIR(st.st_mode);
+        case 's':
+                return st.st_size > 0;
+        case 'p':
+                return S_ISFIFO(st.st_mode);
+        case 'S':
+                return S_ISSOCK(st.st_mode);
+        case 'b':
+                return S_ISBLK(st.st_mode);
+        case 'c':
+                return S_ISCHR(st.st_mode);
+        case 'u':
+                return (st.st_mode & S_ISUID) != 0;
+        case 'g':
+                return (st.st_mode & S_ISGID) != 0;
+        case 'k':
+                return (st.st_mode & S_ISVTX) != 0;
+        default:
+                return 1;
+        }
+}
+
+// Evaluate a binary test, e.g. a = b or 1 -lt 2
+int test_binary(const char *left, const char *op, const char *right) {
+        long long l, r;
+        char *end;
+
+        if (!strcmp(op, "=") || !strcmp(op, "=="))
+                return !strcmp(left, right);
+        if (!strcmp(op, "!="))
+                return strcmp(left, right) != 0;
+        if (!strcmp(op, "-nt") || !strcmp(op, "-ot") || !strcmp(op, "-ef")) {
+                struct stat ls, rs;
+                bool lok = stat(left, &ls) == 0;
+                bool rok = stat(right, &rs) == 0;
+                struct timespec *newer = &ls.st_mtim, *older = &rs.st_mtim;
+
+                if (!strcmp(op, "-ef"))
+                        return lok && rok && ls.st_dev == rs.st_dev && ls.st_ino == rs.st_ino;
+                // a file that exists is newer than one that does not
+                if (!strcmp(op, "-ot")) {
+                        bool swap = lok;
+
+                        lok = rok;
+                        rok = swap;
+                        newer = &rs.st_mtim;
+                        older = &ls.st_mtim;
+                }
+                if (!lok || !rok)
+                        return lok;
+                return newer->tv_sec > older->tv_sec ||
+                        (newer->tv_sec == older->tv_sec && newer->tv_nsec > older->tv_nsec);
+        }
+
+        l = strtoll(left, &end, 10);
+        if (*left == '\0' || *end != '\0')
+                return -1;
+        r = strtoll(right, &end, 10);
+        if (*right == '\0' || *end != '\0')
+                return -1;
+        if (!strcmp(op, "-eq"))
+                return l == r;
+        if (!strcmp(op, "-ne"))
+                return l != r;
+        if (!strcmp(op, "-lt"))
+                return l < r;
+        if (!strcmp(op, "-le"))
+                return l <= r;
+        if (!strcmp(op, "-gt"))
+                return l > r;
+        if (!strcmp(op, "-ge"))
+                return l >= r;
+        return -1;
+}
+
+// A test expression of more than four words, read by recursive descent:
+// "-o" binds looser than "-a", then come "!", "( ... )" and the tests.
+// pos is the next word, and every function returns -1 when the words
+// are not a valid expression.
+struct TestParser {
+        char **args;
+        int argc;
+        int pos;
+};
+
+int test_or(struct TestParser *parser);
+
+int test_primary(struct TestParser *parser) {
+        char **args = parser->args + parser->pos;
+        int left = parser->argc - parser->pos;
+        int result;
+
+        if (left == 0)
+                return -1;
+        if (left >= 3 && test_is_binary(args[1])) {
+                parser->pos += 3;
+                return test_binary(args[0], args[1], args[2]);
+        }
+        if (!strcmp(args[0], "!")) {
+                parser->pos++;
+                result = test_primary(parser);
+                return result == -1 ? -1 : !result;
+        }
+        if (!strcmp(args[0], "(")) {
+                parser->pos++;
+                result = test_or(parser);
+                if (result == -1 || parser->pos == parser->argc ||
+                    strcmp(parser->args[parser->pos], ")"))
+                        return -1;
+                parser->pos++;
+                return result;
+        }
+        if (left >= 2 && test_is_unary(args[0])) {
+                parser->pos += 2;
+                return test_unary(args[0], args[1]);
+        }
+        parser->pos++;
+        return *args[0] != '\0';
+}
+
+int test_and(struct TestParser *parser) {
+        int result = test_primary(parser);
+
+        while (result != -1 && parser->pos < parser->argc &&
+               !strcmp(parser->args[parser->pos], "-a")) {
+                int right;
+
+                parser->pos++;
+                right = test_primary(parser);
+                result = right == -1 ? -1 : result && right;
+        }
+        return result;
+}
+
+int test_or(struct TestParser *parser) {
+        int result = test_and(parser);
+
+        while (result != -1 && parser->pos < parser->argc &&
+               !strcmp(parser->args[parser->pos], "-o")) {
+                int right;
+
+                parser->pos++;
+                right = test_and(parser);
+                result = right == -1 ? -1 : result || right;
+        }
+        return result;
+}
+
+// Evaluate a test expression. Up to four words, it is read by the
+// number of words as POSIX says, and longer ones by test_or.
+// Returns 1 when true, 0 when false and -1 when it is not valid.
+int test_eval(char **args, int argc) {
+        struct TestParser parser = { args, argc, 0 };
+        int result;
+
+        switch (argc) {
+        case 0:
+                return 0;
+        case 1:
+                return *args[0] != '\0';
+        case 2:
+                if (!strcmp(args[0], "!"))
+                        return *args[1] == '\0';
+                return test_unary(args[0], args[1]);
+        case 3:
+                if (test_is_binary(args[1]))
+                        return test_binary(args[0], args[1], args[2]);
+                if (!strcmp(args[1], "-a"))
+                        return *args[0] != '\0' && *args[2] != '\0';
+                if (!strcmp(args[1], "-o"))
+                        return *args[0] != '\0' || *args[2] != '\0';
+                if (!strcmp(args[0], "!")) {
+                        result = test_eval(args + 1, 2);
+                        return result == -1 ? -1 : !result;
+                }
+                if (!strcmp(args[0], "(") && !strcmp(args[2], ")"))
+                        return *args[1] != '\0';
+                return -1;
+        case 4:
+                if (!strcmp(args[0], "!")) {
+                        result = test_eval(args + 1, 3);
+                        return result == -1 ? -1 : !result;
+                }
+                if (!strcmp(args[0], "(") && !strcmp(args[3], ")"))
+                        return test_eval(args + 1, 2);
+                break;
+        }
+        result = test_or(&parser);
+        return parser.pos == argc ? result : -1;
+}
+
+// test expr, [ expr ]
+int builtin_test(struct Command *command) {
+        int argc = command->argc - 1;
+        int result;
+
+        if (!strcmp(command->cmd, "[")) {
+                if (argc == 0 || strcmp(command->args[argc], "]")) {
+                        fprintf(stderr, "[: missing ']'\n");
+                        return 2;
+                }
+                argc--;
+        }
+        result = test_eval(command->args + 1, argc);
+        if (result == -1) {
+                fprintf(stderr, "%s: invalid expression\n", command->cmd);
+                return 2;
+        }
+        return !result;
+}
+
+// Print the escape sequence at *p, and move p to its last character
+void print_escape(const char **p) {
+        const char *c = *p + 1;
+        int value = 0;
+
+        switch (*c) {
+        case 'n': fputc('\n', stdout); break;
+        case 't': fputc('\t', stdout); break;
+        case 'r': fputc('\r', stdout); break;
+        case 'a': fputc('\a', stdout); break;
+        case 'b': fputc('\b', stdout); break;
+        case 'f': fputc('\f', stdout); break;
+        case 'v': fputc('\v', stdout); break;
+        case '\\': fputc('\\', stdout); break;
+        case '0': case '1': case '2': case '3':
+        case '4': case '5': case '6': case '7':
+                for (int i = 0; i < 3 && *c >= '0' && *c <= '7'; i++, c++)
+                        value = value * 8 + (*c - '0');
+                fputc(value, stdout);
+                c--;
+                break;
+        case 'x':
+                for (int i = 0; i < 2; i++) {
+                        char h = c[1];
+
+                        if (h >= '0' && h <= '9')
+                                value = value * 16 + (h - '0');
+                        else if ((h | 0x20) >= 'a' && (h | 0x20) <= 'f')
+                                value = value * 16 + ((h | 0x20) - 'a' + 10);
+                        else
+                                break;
+                        c++;
+                }
+                if (*c == 'x')
+                        fputs("\\x", stdout);
+                else
+                        fputc(value, stdout);
+                break;
+        case '\0':
+                fputc('\\', stdout);
+                c--;
+                break;
+        default:
+                fputc('\\', stdout);
+                fputc(*c, stdout);
+        }
+        *p = c;
+}
+
+// printf format args...
+// The format is used again while there are arguments left.
+int builtin_printf(struct Command *command) {
+        char **arg;
+        const char *format = command->args[1];
+        int status = 0;
+
+        if (format == NULL) {
+                fprintf(stderr, "printf: missing format\n");
+                return 1;
+        }
+        arg = command->args + 2;
+        do {
+                char **start = arg;
+
+                for (const char *p = format; *p; p++) {
+                        char spec[32];
+                        size_t len;
+                        const char *value;
+                        char *end;
+
+                        if (*p == '\\') {
+                                print_escape(&p);
+                                continue;
+                        }
+                        if (*p != '%') {
+                                fputc(*p, stdout);
+                                continue;
+                        }
+                        if (p[1] == '%') {
+                                fputc('%', stdout);
+                                p++;
+                                continue;
+                        }
+
+                        // copy the conversion, with room to add "ll"
+                        len = strspn(p + 1, "-+ #0123456789.") + 1;
+                        if (len + 3 >= sizeof(spec) || p[len] == '\0') {
+                                fputs(p, stdout);
+                                break;
+                        }
+                        memcpy(spec, p, len);
+                        spec[len] = '\0';
+                        value = *arg ? *arg++ : "";
+                        p += len;
+
+                        switch (*p) {
+                        case 'd': case 'i':
+                                strcat(spec, "ll");
+                                strncat(spec, p, 1);
+                                fprintf(stdout, spec, strtoll(value, &end, 0));
+                                if (*end != '\0')
+                                        status = 1;
+                                break;
+                        case 'u': case 'o': case 'x': case 'X':
+                                strcat(spec, "ll");
+                                strncat(spec, p, 1);
+                                fprintf(stdout, spec, strtoull(value, &end, 0));
+                                if (*end != '\0')
+                                        status = 1;
+                                break;
+                        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+                                strncat(spec, p, 1);
+                                fprintf(stdout, spec, strtod(value, &end));
+                                if (*end != '\0')
+                                        status = 1;
+                                break;
+                        case 'c':
+                                strcat(spec, "c");
+                                fprintf(stdout, spec, *value);
+                                break;
+                        case 's':
+                                strcat(spec, "s");
+                                fprintf(stdout, spec, value);
+                                break;
+                        default:
+                                fprintf(stderr, "printf: %c: invalid conversion\n", *p);
+                                return 1;
+                        }
+                }
+                // stop when a pass used no argument
+                if (arg == start)
+                        break;
+        } while (*arg);
+        return status;
+}
+
+// Retry a copy call while it is interrupted, and tell how it ended:
+// 1 when it copied something, 0 at the end of the input, -1 on error
+int copy_result(ssize_t count) {
+        if (count > 0)
+                return 1;
+        return count == 0 ? 0 : -1;
+}
+
+// Copy with read and write, when the kernel cannot do it alone
+int copy_rw(int in, int out) {
+        static char buf[INPUT_CHUNK];
+        ssize_t count;
+
+        while ((count = read(in, buf, sizeof(buf))) != 0) {
+                if (count == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                for (ssize_t done = 0; done < count; ) {
+                        ssize_t written = write(out, buf + done, count - done);
+                        if (written == -1) {
+                                if (errno == EINTR)
                                         continue;
-                                }
+                                return -1;
                         }
-                } else { // the command contains pipe
-                        struct Pipelines pipeline;
-                        error = pipe_split(&pipeline, buffercpy, &pipeCounter);
-                        
-                        if (error.flag == 1){
-                                fprintf(stderr, "%s", error.msg);
+                        done += written;
+                }
+        }
+        return 0;
+}
+
+// Copy everything from in to out inside the kernel when the two allow
+// it: splice when one of them is a pipe, copy_file_range between two
+// regular files, and sendfile from a regular file to anything else.
+// None of them can append, so an O_APPEND output is written.
+// Returns 0, or -1 with errno set.
+int copy_fd(int in, int out) {
+        struct stat in_st, out_st;
+        bool copied = false;
+        int ret;
+
+        if (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1)
+                return -1;
+        if (fcntl(out, F_GETFL) & O_APPEND)
+                return copy_rw(in, out);
+
+        if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+                while ((ret = copy_result(splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE))) == 1 ||
+                       (ret == -1 && errno == EINTR))
+                        copied = true;
+                if (ret == 0)
+                        return 0;
+                if (copied || errno != EINVAL)
+                        return -1;
+        } else if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+                while ((ret = copy_result(copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0))) == 1 ||
+                       (ret == -1 && errno == EINTR))
+                        copied = true;
+                if (ret == 0)
+                        return 0;
+                if (copied || (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+                               errno != EOPNOTSUPP))
+                        return -1;
+        }
+        if (S_ISREG(in_st.st_mode)) {
+                while ((ret = copy_result(sendfile(out, in, NULL, COPY_CHUNK))) == 1 ||
+                       (ret == -1 && errno == EINTR))
+                        copied = true;
+                if (ret == 0)
+                        return 0;
+                if (copied || (errno != EINVAL && errno != ENOSYS))
+                        return -1;
+        }
+        return copy_rw(in, out);
+}
+
+// Whether the arguments from first on are all files, or "-", with no
+// option among them
+bool only_files(struct Command *command, int first) {
+        for (int i = first; i < command->argc; i++) {
+                if (command->args[i][0] == '-' && command->args[i][1] != '\0')
+                        return false;
+        }
+        return true;
+}
+
+bool cat_takes(struct Command *command) {
+        return only_files(command, 1);
+}
+
+// cat [file...]: "-" or no file is stdin
+int builtin_cat(struct Command *command) {
+        int status = 0;
+
+        fflush(stdout);
+        for (int i = 1; i < command->argc || i == 1; i++) {
+                const char *name = command->args[i];
+                int fd = STDIN_FILENO;
+
+                if (name && strcmp(name, "-")) {
+                        fd = open(name, O_RDONLY | O_CLOEXEC);
+                        if (fd == -1) {
+                                fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+                                status = 1;
                                 continue;
                         }
+                }
+                if (copy_fd(fd, STDOUT_FILENO) == -1) {
+                        if (errno != EPIPE)
+                                fprintf(stderr, "cat: %s: %s\n", name ? name : "-", strerror(errno));
+                        status = 1;
+                }
+                if (fd != STDIN_FILENO)
+                        close(fd);
+                if (status && errno == EPIPE)
+                        break;
+        }
+        return status;
+}
+
+bool tee_takes(struct Command *command) {
+        return only_files(command, command->args[1] && !strcmp(command->args[1], "-a") ? 2 : 1);
+}
 
-                        
-
-                        // for(int i = 0; i < pipeCounter; i++){
-                        //         printf("%s\n", pipeline.cmds[i]->cmd);
-                        // }
-                        // generate pipes
-                        for(int i = 0; i < (pipeCounter - 1); i++){
-                            pipeline.pipes[i] = malloc(2*sizeof(int));
-                            //perror(malloc);
-                            pipe(pipeline.pipes[i]);
-                        }
-//                             for (int i = 0; i < pipeCounter; i++){
-//         printf("%d %d\n", pipeline.pipes[i][0], pipeline.pipes[i][1]);
-//     }
-                        
-                        pid = fork();
-                        if (pid == 0) {
-                                // child
-
-                                for(int i = 0; i < pipeCounter; i++){
-                                        if(fork() != 0){ //child - parent
-                                                // parent does nothing.
-                                                
-                                                wait(&status);
-                                                 printf("%d p\n", i);
-                                                 fflush(stdout);
-                                                
-                                                if(status != 0){
-                                                        // if processes generator didn't return normally
-                                                        // return an error
-                                                        //printf("%d error", status);
-                                                        break;
-                                                }
-                                        } else { // child - child
-                                                // child keeps generating processes
-                                                if(i == 0) { //first command : cmds[0]
-                                                        dup2(pipeline.pipes[i][1], STDOUT_FILENO);
-                                                        close(pipeline.pipes[i][1]);
-
-                                                } else if (i == (pipeCounter - 1)){ // last command
-                                                        dup2(pipeline.pipes[i-1][0], STDIN_FILENO);
-                                                        close(pipeline.pipes[i-1][0]);
-
-                                                } else { // commands in the middle
-                                                        dup2(pipeline.pipes[i-1][0], STDIN_FILENO);
-                                                        dup2(pipeline.pipes[i][1], STDOUT_FILENO);
-                                                        close(pipeline.pipes[i][1]);
-                                                        close(pipeline.pipes[i-1][0]);
-                                                }
-                                                printf("%d p\n", i);
-                                                        fflush(stdout);
-                                                execvp(pipeline.cmds[i]->cmd,pipeline.cmds[i]->args);
-                                                perror("execv");
-                                                exit(1);
+// tee [-a] [file...]: copy stdin to stdout and to every file. Between
+// two pipes and into one file, the data is duplicated by tee(2) and
+// spliced into the file, so it never leaves the kernel.
+int builtin_tee(struct Command *command) {
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        int first = 1;
+        int nfiles = 0;
+        int *fds;
+        int status = 0;
+        struct stat in_st, out_st;
+        static char buf[INPUT_CHUNK];
+        ssize_t count;
+
+        if (command->args[1] && !strcmp(command->args[1], "-a")) {
+                flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+                first = 2;
+        }
+        fds = malloc((command->argc + 1) * sizeof(int));
+        fds[nfiles++] = STDOUT_FILENO;
+        for (int i = first; i < command->argc; i++) {
+                int fd = open(command->args[i], flags, 0666);
+                if (fd == -1) {
+                        fprintf(stderr, "tee: %s: %s\n", command->args[i], strerror(errno));
+                        status = 1;
+                        continue;
+                }
+                fds[nfiles++] = fd;
+        }
+        fflush(stdout);
+
+        if (nfiles == 2 && !(flags & O_APPEND) &&
+            fstat(STDIN_FILENO, &in_st) == 0 && fstat(STDOUT_FILENO, &out_st) == 0 &&
+            S_ISFIFO(in_st.st_mode) && S_ISFIFO(out_st.st_mode)) {
+                while ((count = tee(STDIN_FILENO, STDOUT_FILENO, COPY_CHUNK, 0)) != 0) {
+                        if (count == -1) {
+                                if (errno == EINTR)
+                                        continue;
+                                status = 1;
+                                break;
+                        }
+                        // consume what was duplicated, into the file
+                        while (count > 0) {
+                                ssize_t moved = splice(STDIN_FILENO, NULL, fds[1], NULL,
+                                                       count, SPLICE_F_MOVE);
+                                if (moved == -1 && errno == EINTR)
+                                        continue;
+                                if (moved <= 0) {
+                                        status = 1;
+                                        break;
+                                }
+                                count -= moved;
+                        }
+                        if (status)
+                                break;
+                }
+        } else {
+                while ((count = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+                        if (count == -1) {
+                                if (errno == EINTR)
+                                        continue;
+                                status = 1;
+                                break;
+                        }
+                        for (int i = 0; i < nfiles; i++) {
+                                for (ssize_t done = 0; done < count; ) {
+                                        ssize_t written = write(fds[i], buf + done, count - done);
+                                        if (written == -1 && errno == EINTR)
+                                                continue;
+                                        if (written == -1) {
+                                                status = 1;
+                                                break;
                                         }
+                                        done += written;
                                 }
-                                if(status != 0)
-                                        exit(1);
-                                exit(0);
-                                
-                                
-                        } else if (pid > 0){
-                                // parent
-                                wait(&status);
-                                fprintf(stderr, "+ completed \'%s\' [%d]\n", buffer, WEXITSTATUS(status));
-                        } else {
-                                perror("fork");
-                                exit(1);
                         }
+                }
+        }
+        for (int i = 1; i < nfiles; i++)
+                close(fds[i]);
+        free(fds);
+        return status;
+}
+
+// Build the command of one parallel task: every "{}" in the template is
+// replaced by the input, or the input is added at the end if there is
+// no "{}". The words that change are allocated, the others are shared
+// with the template.
+void parallel_task(char **template, int count, char *input, struct Command *task) {
+        bool placed = false;
+
+        task->argc = 0;
+        for (int i = 0; i < count; i++) {
+                char *word = template[i];
+                char *mark = strstr(word, "{}");
+
+                if (mark) {
+                        size_t marks = 0;
+                        char *out, *end;
+
+                        for (char *m = mark; m; m = strstr(m + 2, "{}"))
+                                marks++;
+                        out = malloc(strlen(word) + marks * strlen(input) + 1);
+                        end = out;
+                        for (; mark; word = mark + 2, mark = strstr(word, "{}")) {
+                                memcpy(end, word, mark - word);
+                                end += mark - word;
+                                end = stpcpy(end, input);
+                        }
+                        strcpy(end, word);
+                        word = out;
+                        placed = true;
+                }
+                task->args[task->argc++] = word;
+        }
+        if (!placed)
+                task->args[task->argc++] = input;
+        task->args[task->argc] = NULL;
+        task->cmd = task->args[0];
+}
+
+void parallel_task_free(char **template, int count, struct Command *task) {
+        for (int i = 0; i < count; i++) {
+                if (task->args[i] != template[i])
+                        free(task->args[i]);
+        }
+}
+
+// Write out what a finished task printed, stdout then stderr
+void parallel_flush(int output[2]) {
+        fflush(stdout);
+        lseek(output[0], 0, SEEK_SET);
+        copy_fd(output[0], STDOUT_FILENO);
+        lseek(output[1], 0, SEEK_SET);
+        copy_fd(output[1], STDERR_FILENO);
+        close(output[0]);
+        close(output[1]);
+        output[0] = -1;
+}
+
+// parallel [-j N] command args... ::: inputs...
+// Run the command once per input, N at a time (one per CPU by default),
+// all in one job whose stages are the tasks. A new task is started as
+// soon as the SIGCHLD handler reaps one. Each task writes into its own
+// memfds, copied to the shell's stdout and stderr once it is done, so
+// the output of two tasks is never mixed.
+int builtin_parallel(struct Command *command) {
+        long max = sysconf(_SC_NPROCESSORS_ONLN);
+        int first = 1;
+        int sep, ntasks, next = 0;
+        char **template;
+        int (*outputs)[2];
+        struct Command task;
+        struct Job job = {0};
+        sigset_t old;
+        int failed = 0;
+
+        if (command->args[1] && !strcmp(command->args[1], "-j")) {
+                char *end;
+
+                max = command->args[2] ? strtol(command->args[2], &end, 10) : 0;
+                if (command->args[2] == NULL || *end != '\0' || max < 1) {
+                        fprintf(stderr, "parallel: -j needs a number of tasks\n");
+                        return 2;
+                }
+                first = 3;
+        }
+        for (sep = first; sep < command->argc && strcmp(command->args[sep], ":::"); sep++)
+                ;
+        if (sep == command->argc) {
+                fprintf(stderr, "parallel: missing :::\n");
+                return 2;
+        }
+        if (sep == first) {
+                fprintf(stderr, "parallel: missing command\n");
+                return 2;
+        }
+        template = command->args + first;
+        ntasks = command->argc - sep - 1;
+        if (ntasks == 0)
+                return 0;
+
+        job.cmdline = builtin_text;
+        job.count = ntasks;
+        job.pids = calloc(ntasks, sizeof(pid_t));
+        job.status = calloc(ntasks, sizeof(int));
+        job.usage = calloc(ntasks, sizeof(struct StageUsage));
+        outputs = malloc(ntasks * sizeof(int[2]));
+        task.args = malloc((sep - first + 2) * sizeof(char *));
+        clock_gettime(CLOCK_MONOTONIC, &job.start);
+
+        fflush(stdout);
+        block_sigchld(&old);
+        job_add(&job);
+        while (next < ntasks || job.running > 0) {
+                if (next < ntasks && job.running < max) {
+                        // the group dies with its last task, then the
+                        // next one starts a new one
+                        struct Launch plan = { .nactions = 0, .pgid = job.running ? job.pgid : 0 };
+                        const struct Builtin *builtin;
+                        int i = next++;
+
+                        outputs[i][0] = memfd_create("parallel-stdout", MFD_CLOEXEC);
+                        outputs[i][1] = memfd_create("parallel-stderr", MFD_CLOEXEC);
+                        if (outputs[i][0] == -1 || outputs[i][1] == -1) {
+                                fprintf(stderr, "parallel: memfd_create: %s\n", strerror(errno));
+                                if (outputs[i][0] != -1)
+                                        close(outputs[i][0]);
+                                if (outputs[i][1] != -1)
+                                        close(outputs[i][1]);
+                                outputs[i][0] = -1;
+                                job.pids[i] = -1;
+                                job.status[i] = 1 << 8;
+                                continue;
+                        }
+                        plan_dup(&plan, outputs[i][0], STDOUT_FILENO);
+                        plan_dup(&plan, outputs[i][1], STDERR_FILENO);
+                        parallel_task(template, sep - first, command->args[sep + 1 + i], &task);
+                        builtin = find_builtin(&task);
+                        if (builtin && builtin->utility)
+                                job.pids[i] = launch_builtin(builtin, &task, &plan);
+                        else
+                                job.pids[i] = launch(&task, &plan);
+                        if (job.pids[i] == -1)
+                                exec_error(outputs[i][1], task.cmd, errno);
+                        parallel_task_free(template, sep - first, &task);
+                        if (job.pids[i] == -1) {
+                                job.status[i] = 1 << 8;
+                                parallel_flush(outputs[i]);
+                                continue;
+                        }
+                        stage_started(&job.usage[i], job.pids[i]);
+                        if (job.running++ == 0) {
+                                job.pgid = job.pids[i];
+                                set_foreground(job.pgid);
+                        }
+                        continue;
+                }
+                sigsuspend(&old);
+                if (job.stopped) {
+                        // the tasks cannot be left stopped in the shell
+                        kill(-job.pgid, SIGCONT);
+                        job.stopped = false;
+                }
+                for (int i = 0; i < next; i++) {
+                        if (job.pids[i] == -1 && outputs[i][0] != -1)
+                                parallel_flush(outputs[i]);
+                }
+        }
+        job_remove(&job);
+        set_foreground(getpgrp());
+        unblock_sigchld(&old);
+
+        print_completed(&job);
+        for (int i = 0; i < ntasks; i++) {
+                if (job.status[i] != 0)
+                        failed = 1;
+        }
+        free(task.args);
+        free(outputs);
+        free(job.usage);
+        free(job.status);
+        free(job.pids);
+        return failed;
+}
+
+// The builtin dispatch table
+static const struct Builtin builtins[] = {
+        { "exit", builtin_exit, false, false, NULL },
+        { "pwd", builtin_pwd, false, false, NULL },
+        { "cd", builtin_cd, false, false, NULL },
+        { "hash", builtin_hash, false, false, NULL },
+        { "jobs", builtin_jobs, false, false, NULL },
+        { "wait", builtin_wait, false, false, NULL },
+        { "fg", builtin_fg, false, false, NULL },
+        { "pushd", builtin_pushd, false, false, NULL },
+        { "popd", builtin_popd, false, false, NULL },
+        { "dirs", builtin_dirs, false, false, NULL },
+        { "set", builtin_set, false, false, NULL },
+        { "parallel", builtin_parallel, false, false, NULL },
+        { "history", builtin_history, true, false, NULL },
+        { "stats", builtin_stats, true, false, NULL },
+        { "echo", builtin_echo, true, false, NULL },
+        { "true", builtin_true, true, false, NULL },
+        { "false", builtin_false, true, false, NULL },
+        { "test", builtin_test, true, false, NULL },
+        { "[", builtin_test, true, false, NULL },
+        { "printf", builtin_printf, true, false, NULL },
+        { "cat", builtin_cat, true, true, cat_takes },
+        { "tee", builtin_tee, true, true, tee_takes },
+};
+
+// The builtin that runs the command, NULL if the command is external or
+// has arguments its builtin does not take
+const struct Builtin *find_builtin(struct Command *command) {
+        for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+                if (!strcmp(builtins[i].name, command->cmd)) {
+                        if (builtins[i].takes && !builtins[i].takes(command))
+                                return NULL;
+                        return &builtins[i];
+                }
+        }
+        return NULL;
+}
+
+// Run the pipelines of a line in order. After '&&' a pipeline only runs
+// if the last one that ran succeeded, and after '||' only if it failed.
+void run_list(struct Arena *arena, struct CommandList *list) {
+        for (int i = 0; i < list->count; i++) {
+                struct Pipelines *pipeline = &list->pipelines[i];
+                const struct Builtin *builtin;
+                struct Error error;
+                uint64_t start;
+
+                if ((pipeline->op == LIST_AND && last_status != 0) ||
+                    (pipeline->op == LIST_OR && last_status == 0))
+                        continue;
+
+                start = clock_ns();
+                expand_pipeline(arena, pipeline);
+
+                // a command whose words all expanded to nothing: alone,
+                // it does nothing, in a pipeline it is missing
+                if (pipeline->count == 1 && pipeline->cmds[0].argc == 0) {
+                        last_status = 0;
+                        continue;
+                }
+                error.flag = 0;
+                for (int j = 0; j < pipeline->count; j++) {
+                        if (pipeline->cmds[j].argc == 0)
+                                error.flag = 1;
+                }
+                if (error.flag == 1) {
+                        fprintf(stderr, "Error: missing command\n");
+                        last_status = 1;
+                        continue;
+                }
+
+                // time: report the resources the pipeline used
+                // pipesize=SIZE: capacity of its pipes, for it only
+                error.flag = 0;
+                while (!strcmp(pipeline->cmds[0].cmd, "time") ||
+                       !strncmp(pipeline->cmds[0].cmd, "pipesize=", 9)) {
+                        struct Command *command = &pipeline->cmds[0];
+                        if (!strcmp(command->cmd, "time")) {
+                                pipeline->timed = true;
+                        } else if ((pipeline->pipesize = parse_size(command->cmd + 9)) == -1) {
+                                fprintf(stderr, "Error: invalid pipe size\n");
+                                error.flag = 1;
+                                break;
+                        }
+                        if (command->argc == 1) {
+                                fprintf(stderr, "Error: missing command\n");
+                                error.flag = 1;
+                                break;
+                        }
+                        command->args++;
+                        command->argc--;
+                        command->cmd = command->args[0];
+                }
+                if (error.flag == 1) {
+                        last_status = 1;
+                        continue;
+                }
+                if (time_all)
+                        pipeline->timed = true;
+
+                // limit NAME=VALUE..., pin CPUS: for each stage
+                for (int j = 0; j < pipeline->count && error.flag == 0; j++) {
+                        struct Command *command = &pipeline->cmds[j];
+
+                        if (!limit_prefixes(arena, command)) {
+                                error.flag = 1;
+                        } else if (command->limits && (builtin = find_builtin(command)) &&
+                                   !builtin->utility) {
+                                fprintf(stderr, "Error: %s runs in the shell, it cannot be limited\n",
+                                        command->cmd);
+                                error.flag = 1;
+                        }
+                }
+                stat_text(STAT_EXPAND, pipeline->text, start);
+                if (error.flag == 1) {
+                        last_status = 1;
+                        continue;
+                }
+
+                /* Builtin command, run in the shell unless it has to be a
+                 * background job or has limits */
+                builtin = find_builtin(&pipeline->cmds[0]);
+                if (pipeline->count == 1 && builtin && !builtin->utility && pipeline->background) {
+                        fprintf(stderr, "Error: %s runs in the shell, it cannot run in the background\n",
+                                builtin->name);
+                        last_status = 1;
+                        continue;
+                }
+                if (pipeline->count == 1 && builtin &&
+                    !(pipeline->background && builtin->utility) && !pipeline->cmds[0].limits)
+                        error = run_builtin(builtin, pipeline);
+                else
+                        // not built in, a single command or a pipeline
+                        error = run_pipeline(pipeline);
+                if (error.flag == 1) {
+                        fprintf(stderr, "%s", error.msg);
+                        last_status = 1;
+                }
+        }
+}
+
+// Run the commands of a $(...) in a copy of the shell, and get what they
+// print, without the newlines at the end. It is read from a pipe as it
+// comes, into a buffer growing in the arena.
+char *command_output(struct Arena *arena, const char *text, size_t len) {
+        struct StrBuf out;
+        char *line;
+        sigset_t old;
+        int fds[2];
+        pid_t pid;
+
+        strbuf_init(&out, arena, 64);
+        line = arena_alloc(arena, len + 1);
+        memcpy(line, text, len);
+        line[len] = '\0';
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+                perror("pipe");
+                return out.data;
+        }
+
+        fflush(stdout);
+        // the copy is waited for here, not by the SIGCHLD handler
+        block_sigchld(&old);
+        pid = fork();
+        if (pid == 0) {
+                struct Arena sub = { NULL, NULL };
+                struct CommandList list;
+                struct Error error;
+
+                dup2(fds[1], STDOUT_FILENO);
+                close(fds[0]);
+                close(fds[1]);
+                // the shell's jobs are not children of the copy, and the
+                // zygote reports to the shell
+                jobs = NULL;
+                zygote_stop();
+                quiet = true;
+                time_all = false;
+                unblock_sigchld(&old);
+                error = parse_line(&sub, line, &list);
+                if (error.flag == 1) {
+                        fprintf(stderr, "%s", error.msg);
+                        _exit(2);
+                }
+                run_list(&sub, &list);
+                fflush(stdout);
+                _exit(last_status);
+        }
+        close(fds[1]);
+        if (pid == -1)
+                perror("fork");
+        while (pid > 0) {
+                ssize_t count;
+
+                if (out.cap - out.len < INPUT_CHUNK / 4) {
+                        out.data = arena_grow(arena, out.data, out.cap);
+                        out.cap *= 2;
+                }
+                count = read(fds[0], out.data + out.len, out.cap - out.len - 1);
+                if (count == -1 && errno == EINTR)
+                        continue;
+                if (count <= 0)
+                        break;
+                out.len += count;
+        }
+        close(fds[0]);
+        if (pid > 0)
+                waitpid(pid, NULL, 0);
+        unblock_sigchld(&old);
+
+        while (out.len > 0 && out.data[out.len - 1] == '\n')
+                out.len--;
+        out.data[out.len] = '\0';
+        return out.data;
+}
+
+void usage(void) {
+        fprintf(stderr, "usage: sshell [-qt] [-s | -c command | script]\n");
+        exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+        char *buffer; // the command line
+        struct Input input; // where the lines are read from
+        bool interactive = true; // print the prompt and echo the lines
+        bool keep_history; // typed at a terminal: "!" and the history file
+        struct Arena arena = { NULL, NULL }; // memory of the parsed line
+        struct sigaction sigchld_action; // reaps children as they exit
+        static bool once = true;
+        char *command_string = NULL;
+        uint64_t start; // when the line's parsing started
+        int opt;
+
+        // -c command: run the command
+        // -s: read commands from stdin without prompt or echo
+        // -q: leave out the "+ completed" lines
+        // -t: report the resources used by every pipeline
+        // script: run the commands of the file
+        while ((opt = getopt(argc, argv, "c:sqt")) != -1) {
+                switch (opt) {
+                case 'c':
+                        command_string = optarg;
+                        interactive = false;
+                        break;
+                case 's':
+                        interactive = false;
+                        break;
+                case 'q':
+                        quiet = true;
+                        break;
+                case 't':
+                        time_all = true;
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (command_string) {
+                if (optind != argc)
+                        usage();
+                input_open_string(&input, command_string);
+        } else if (optind < argc) {
+                int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+                if (optind + 1 != argc)
+                        usage();
+                if (fd == -1) {
+                        fprintf(stderr, "Error: cannot open script %s\n", argv[optind]);
+                        return EXIT_FAILURE;
+                }
+                input_open_fd(&input, fd);
+                interactive = false;
+        } else {
+                input_open_fd(&input, STDIN_FILENO);
+        }
+
+        // the shell moves pipelines to the foreground, so it must not be
+        // stopped when it takes the terminal back
+        signal(SIGTTOU, SIG_IGN);
+        sigchld_action.sa_handler = sigchld_handler;
+        sigemptyset(&sigchld_action.sa_mask);
+        sigchld_action.sa_flags = SA_RESTART;
+        sigaction(SIGCHLD, &sigchld_action, NULL);
+        launch_init();
+        trace_open();
+        keep_history = interactive && isatty(STDIN_FILENO);
+        if (keep_history)
+                history_open();
+
+        while (1) {
+                struct CommandList list; // the parsed line
+                struct Error error;
                 
+                if (once) {
+                        once = false;
+                        dirs_init();
+                }
+
+                /* Report background jobs that are done */
+                report_jobs();
 
+                /* Print prompt */
+                if (interactive)
+                        print_prompt();
+
+                /* Get command line, without its trailing newline */
+                buffer = input_read_line(&input);
+                if (buffer == NULL)
+                        break;
+
+                /* Print command line if stdin is not provided by terminal */
+                if (interactive && !isatty(STDIN_FILENO)) {
+                        printf("%s\n", buffer);
+                        fflush(stdout);
+                }
+
+                arena_reset(&arena);
+                if (keep_history) {
+                        /* Replace the "!" references, and keep the line */
+                        char *typed = buffer;
+
+                        error = history_expand(&arena, &buffer);
+                        if (error.flag == 1) {
+                                fprintf(stderr, "%s", error.msg);
+                                last_status = 1;
+                                continue;
+                        }
+                        if (buffer != typed) {
+                                printf("%s\n", buffer);
+                                fflush(stdout);
+                        }
+                        history_add(buffer);
+                }
+
+                /* Parse the whole line once, into the arena */
+                start = clock_ns();
+                error = parse_line(&arena, buffer, &list);
+                stat_text(STAT_PARSE, buffer, start);
+                if (error.flag == 1) {
+                        fprintf(stderr, "%s", error.msg);
+                        last_status = 2;
+                        continue;
                 }
+                input_read_here(&input, &arena, &list, interactive);
+                run_list(&arena, &list);
         }
 
-        return EXIT_SUCCESS;
+        return last_status;
 }